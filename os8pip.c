@@ -18,7 +18,11 @@
 
 */
 
+/* memfd_create and friends on Linux, harmless elsewhere */
+#define _GNU_SOURCE
+
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -31,8 +35,34 @@
 #include <ctype.h>
 #include <limits.h>
 #include <assert.h>
+#include <errno.h>
 #include <libgen.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <regex.h>
+#include <dirent.h>
+
+/* Compressed images need the libraries at build time, e.g.
+   cc -DHAVE_ZLIB -DHAVE_ZSTD os8pip.c -lz -lzstd
+*/
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Bulk reads use io_uring on Linux, through the system calls so there's nothing to
+   link with.  cc -DNO_IO_URING leaves it out.
+*/
+#if !defined(NO_IO_URING) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
@@ -53,6 +83,43 @@ typedef const char * const_str_t;
 /* Mac PDP-8/e simulator packs two 12-bit words in three bytes */
 #define RK05_BLOCK_SIZE 384
 #define RK05_RKB_OFFSET 3248
+#define RK05_LENGTH (RK05_RKB_OFFSET * 2 * RK05_BLOCK_SIZE)
+
+/* simh stores the whole pack, 203 cylinders of two surfaces of 16 256-word sectors,
+   as 16-bit little-endian words.
+*/
+#define SIMH_RK05_LENGTH (203 * 2 * 16 * OS8_BLOCK_SIZE * 2)
+
+/* RX01 and RX02 floppies have 77 tracks of 26 sectors.  In 12-bit mode the RX8E
+   packs two words into three bytes, 64 words into a 128 byte RX01 sector or 128
+   words into a 256 byte RX02 sector, leaving the rest of the sector unused.
+   OS/8 doesn't use track 0 and interleaves the sectors of each track 2:1.
+*/
+#define RX_TRACKS 77
+#define RX_SECTORS 26
+#define RX_FIRST_TRACK 1
+#define RX_INTERLEAVE 2
+#define RX_TRACK_SKEW 0
+#define RX_LOGICAL_SECTORS ((RX_TRACKS - RX_FIRST_TRACK) * RX_SECTORS)
+#define RX01_SECTOR_SIZE 128
+#define RX02_SECTOR_SIZE 256
+#define RX01_LENGTH (RX_TRACKS * RX_SECTORS * RX01_SECTOR_SIZE)
+#define RX02_LENGTH (RX_TRACKS * RX_SECTORS * RX02_SECTOR_SIZE)
+#define RX01_BLOCKS (RX_LOGICAL_SECTORS / 4)
+#define RX02_BLOCKS (RX_LOGICAL_SECTORS / 2)
+
+/* Packed-12 images hold the blocks of any device densely, two words in three bytes
+   like the Mac RK05 format, following a header that records the device they came
+   from and how many blocks it has.
+*/
+#define PACKED12_MAGIC "OS8PK12\n"
+#define PACKED12_VERSION 1
+#define PACKED12_HEADER_SIZE 16
+
+/* simh dsk images can be any size OS/8 can address */
+#define RF08_BLOCKS 1024
+#define RK05_BLOCKS RK05_RKB_OFFSET
+#define DSK_MAX_BLOCKS 4096
 
 #define DIR_LENGTH 6
 #define FIRST_DIR_BLOCK 1
@@ -61,6 +128,7 @@ typedef struct {
     unsigned last_block_no;
     unsigned filesystem_size;
     unsigned size;
+    off_t image_size; /* bytes in a full device image file */
 } device_t;
 
 /* Byte buffer must be large enough to hold 2 129-word DECTape blocks.  This
@@ -125,7 +193,7 @@ typedef struct {
 
 #define EMPTY_ENTRY_LENGTH 2
 
-typedef enum {unknown, dectape, dsk, rk05, tu56} format_t;
+typedef enum {unknown, dectape, dsk, rk05, simh_rk05, rx01, rx02, packed12, tu56} format_t;
 typedef enum {base, rka, rkb} rk05_filesystem_t; /* currently RK05 RKA and RKB only */
 
 /* Used for wildcard matching of filenames in sixbit */
@@ -275,7 +343,7 @@ filename_type_t filename_type(char *filename)
         return unknown_type;
     }
 
-    char extension[strlen(dot_pos)];
+    char extension[strlen(dot_pos) + 1];
     strcpy(extension, dot_pos);
     convert_lower(extension);
     for (map_t *p = map; p->extension != NULL; p++) {
@@ -286,6 +354,15 @@ filename_type_t filename_type(char *filename)
     return unknown_type;
 }
 
+/* --text and --image override the extension */
+typedef enum {no_mode, text_mode, image_mode} copy_mode_t;
+
+filename_type_t copy_type(char *filename, copy_mode_t mode)
+{
+    return mode == text_mode ? text_type :
+           mode == image_mode ? unknown_type : filename_type(filename);
+}
+
 bool os8_filename_part_p(char *part, unsigned length)
 {
     for (char *s = part; s < part + length; s++) {
@@ -897,7 +974,7 @@ bool enter(const_str_t filename, const int length, directory_t directory, entry_
                 directory[index].d.dir_struct.number_files = negate(1);
                 get_last_entry(dir_block, &temp_entry);
                 directory[index].d.dir_struct.first_file_block = temp_entry.file_block +
-                                                    entry_length(temp_entry);
+                                                    temp_entry.length;
                 directory[index].d.dir_struct.next_segment = 0;
                 directory[index].d.dir_struct.flag_word = 0;
                 directory[index].d.dir_struct.additional_words = dir_block->d.dir_struct.additional_words;
@@ -952,6 +1029,44 @@ bool enter(const_str_t filename, const int length, directory_t directory, entry_
 
 typedef bool (*block_io_t)(int, unsigned, os8_block_t);
 
+/* Multi-block readers and writers transfer "count" consecutive OS/8 blocks with a
+   single pread or pwrite, the single block readers and writers are built on them.
+*/
+typedef bool (*blocks_io_t)(int, unsigned, unsigned, os8_block_t *);
+
+/* Decoders turn the bytes of a run of blocks, as read from the image file, into
+   words.  The readers use them after their pread, the asynchronous reader after
+   its reads complete.
+*/
+typedef bool (*decode_t)(unsigned, unsigned, unsigned char *, os8_block_t *);
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_LITTLE_ENDIAN 1
+#else
+#define HOST_LITTLE_ENDIAN 0
+#endif
+
+/* --scrub lists the bad blocks itself once it has read them all, so its threads
+   turn off the message a block with bits set above the twelfth one gets.  So does
+   read_directory while it reads segments that may not be in use.
+*/
+static _Thread_local bool corruption_quiet_p;
+
+bool validate_words(unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    for (unsigned i = 0; i < count; i++) {
+        for (pdp8_word_t *word_ptr = blocks[i]; word_ptr < blocks[i] + OS8_BLOCK_SIZE; word_ptr++) {
+            if ((*word_ptr & 0170000) != 0) {
+                if (!corruption_quiet_p) {
+                    printf("block %i appears to be corrupted\n", block_no + i);
+                }
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 bool byte_buffer_to_word_buffer(unsigned block_no, byte_buffer_t byte_buffer, os8_block_t block_buffer)
 {
     unsigned char *byte_ptr = byte_buffer;
@@ -964,876 +1079,5910 @@ bool byte_buffer_to_word_buffer(unsigned block_no, byte_buffer_t byte_buffer, os
         *word_ptr =  *byte_ptr++;
         *word_ptr |= *byte_ptr++ << 8;
         if ((*word_ptr++ & 0170000) != 0) {
-            printf("block %i appears to be corrupted\n", block_no);
+            if (!corruption_quiet_p) {
+                printf("block %i appears to be corrupted\n", block_no);
+            }
             return false;
         }
     } while (word_ptr < block_buffer + OS8_BLOCK_SIZE);
     return true;
 }
 
-bool write_dsk_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+void word_buffer_to_byte_buffer(os8_block_t block_buffer, unsigned char *byte_buffer)
 {
-    byte_buffer_t byte_buffer;
+    for (pdp8_word_t *word_ptr = block_buffer; word_ptr < block_buffer + OS8_BLOCK_SIZE; word_ptr++) {
+        *byte_buffer++ = *word_ptr & 0377;
+        *byte_buffer++ = *word_ptr >> 8;
+    }
+}
 
-    unsigned char *byte_ptr = byte_buffer;
-    pdp8_word_t *word_ptr = block_buffer;   
+/* Pack pairs of 12-bit words into three bytes, the way the RK05 and RX codecs store
+   them.  word_count must be even, block_no is only used for reporting corruption.
+*/
+bool pack_words(unsigned block_no, pdp8_word_t *words, unsigned word_count, unsigned char *byte_buffer)
+{
+    pdp8_word_t w1, w2;
 
-    do {
-        if ((*word_ptr & 0170000) != 0) {
-            printf("Buffer for block %i appears to be corrupted, write aborted\n", block_no);
+    for (unsigned i = 0; i < word_count; i += 2) {
+        w1 = words[i];
+        w2 = words[i + 1];
+        if (((w1 & 0170000) != 0) || ((w2 & 0170000) != 0)) {
+            printf("Buffer for block %i appears to be corrupted, write aborted\n",
+                   block_no + i / OS8_BLOCK_SIZE);
             return false;
         }
-        *byte_ptr++ = *word_ptr & 0377;
-        *byte_ptr++ = *word_ptr++ >> 8;
-    } while (word_ptr < block_buffer + OS8_BLOCK_SIZE);
-
-    unsigned bytes = pwrite(os8_file, byte_buffer, OS8_BLOCK_SIZE * 2, block_no * OS8_BLOCK_SIZE * 2);
-    return bytes == OS8_BLOCK_SIZE * 2;
+        *byte_buffer++ = w1 >> 4;
+        *byte_buffer++ = ((w1 & 017) << 4) | (w2 >> 8);
+        *byte_buffer++ = w2 & 0377;
+    }
+    return true;
 }
 
-bool write_dectape_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+void unpack_words(unsigned char *byte_buffer, pdp8_word_t *words, unsigned word_count)
 {
-    byte_buffer_t byte_buffer;
+    unsigned char c1, c2, c3;
 
-    /* Unconverted simh DECTape files have 129 12-bit words per block of which 128 are used by OS/8.
-       This means that we have to write two DECTAPE_BLOCK_SIZE segments containing one extra 12-bit
-       garbage word for each OS/8 block of 256 12-bit word.
-    */
+    for (pdp8_word_t *word_ptr = words; word_ptr < words + word_count;) {
+        c1 = *byte_buffer++;
+        c2 = *byte_buffer++;
+        c3 = *byte_buffer++;
+        *word_ptr++ = (pdp8_word_t)((c1 << 4) | (c2 >> 4));
+        *word_ptr++ = (pdp8_word_t)(((c2 & 017) << 8) | c3);
+    }
+}
 
-    pdp8_word_t *word_ptr = block_buffer;
-    unsigned byte_offset = block_no * DECTAPE_BLOCK_SIZE * 2;
+bool write_dsk_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    size_t length = (size_t)count * OS8_BLOCK_SIZE * 2;
 
-    do {
-        unsigned char* byte_ptr = byte_buffer;
-        do {
+    for (unsigned i = 0; i < count; i++) {
+        for (pdp8_word_t *word_ptr = blocks[i]; word_ptr < blocks[i] + OS8_BLOCK_SIZE; word_ptr++) {
             if ((*word_ptr & 0170000) != 0) {
-                printf("Buffer for block %i appears to be corrupted, write aborted\n", block_no);
+                printf("Buffer for block %i appears to be corrupted, write aborted\n", block_no + i);
                 return false;
             }
-            *byte_ptr++ = *word_ptr & 0377;
-            *byte_ptr++ = *word_ptr++ >> 8;
-        } while (byte_ptr < byte_buffer + OS8_BLOCK_SIZE);
-        *byte_ptr++ = 0; *byte_ptr++ = 0; /* not necessary but make the block look clean */
-        unsigned bytes = pwrite(os8_file, byte_buffer, DECTAPE_BLOCK_SIZE, byte_offset);
-        if (bytes != DECTAPE_BLOCK_SIZE) {
-            return false;
         }
-        byte_offset += DECTAPE_BLOCK_SIZE;
-    } while (word_ptr < block_buffer + OS8_BLOCK_SIZE);
+    }
 
-    return true;
+#if HOST_LITTLE_ENDIAN
+    /* The dsk layout is our in-memory layout, so write straight from the caller's buffer */
+    ssize_t bytes = pwrite(os8_file, blocks, length, (off_t)block_no * OS8_BLOCK_SIZE * 2);
+#else
+    unsigned char *byte_buffer;
+    if ((byte_buffer = malloc(length)) == NULL) {
+        perror("malloc");
+        return false;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        word_buffer_to_byte_buffer(blocks[i], byte_buffer + i * OS8_BLOCK_SIZE * 2);
+    }
+    ssize_t bytes = pwrite(os8_file, byte_buffer, length, (off_t)block_no * OS8_BLOCK_SIZE * 2);
+    free(byte_buffer);
+#endif
+    return bytes == (ssize_t)length;
 }
 
-bool write_rka_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+bool write_dsk_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
 {
-    byte_buffer_t byte_buffer;
+    return write_dsk_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-    pdp8_word_t w1, w2;
-    pdp8_word_t *block_ptr = block_buffer;
-    unsigned char *buf_ptr = byte_buffer;
+bool write_dectape_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    /* Unconverted simh DECTape files have 129 12-bit words per block of which 128 are used by OS/8.
+       This means that we have to write two DECTAPE_BLOCK_SIZE segments containing one extra 12-bit
+       garbage word for each OS/8 block of 256 12-bit word.  The whole run is assembled in memory
+       and written at once.
+    */
+    size_t length = (size_t)count * DECTAPE_BLOCK_SIZE * 2;
+    unsigned char *byte_buffer;
 
-    do {
-        w1 = *block_ptr++;
-        w2 = *block_ptr++;
-        if (((w1 & 0170000) != 0) || ((w2 & 0170000) != 0)) {
-            printf("Buffer for block %i appears to be corrupted, write aborted\n", block_no);
-            return false;
-        }
-        *buf_ptr++ = w1 >> 4;
-        *buf_ptr++ = ((w1 & 017) << 4) | (w2 >> 8);
-        *buf_ptr++ = w2 & 0377;
-    } while (block_ptr < block_buffer + OS8_BLOCK_SIZE);
+    if ((byte_buffer = malloc(length)) == NULL) {
+        perror("malloc");
+        return false;
+    }
+
+    unsigned char *byte_ptr = byte_buffer;
+    for (unsigned i = 0; i < count; i++) {
+        pdp8_word_t *word_ptr = blocks[i];
+        do {
+            unsigned char *segment_end = byte_ptr + OS8_BLOCK_SIZE;
+            do {
+                if ((*word_ptr & 0170000) != 0) {
+                    printf("Buffer for block %i appears to be corrupted, write aborted\n", block_no + i);
+                    free(byte_buffer);
+                    return false;
+                }
+                *byte_ptr++ = *word_ptr & 0377;
+                *byte_ptr++ = *word_ptr++ >> 8;
+            } while (byte_ptr < segment_end);
+            *byte_ptr++ = 0; *byte_ptr++ = 0; /* not necessary but make the block look clean */
+        } while (word_ptr < blocks[i] + OS8_BLOCK_SIZE);
+    }
 
-    unsigned bytes = pwrite(os8_file, byte_buffer, RK05_BLOCK_SIZE, block_no * RK05_BLOCK_SIZE);
-    return bytes == RK05_BLOCK_SIZE;
+    ssize_t bytes = pwrite(os8_file, byte_buffer, length, (off_t)block_no * DECTAPE_BLOCK_SIZE * 2);
+    free(byte_buffer);
+    return bytes == (ssize_t)length;
 }
 
-bool write_rkb_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+bool write_dectape_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
 {
-    return write_rka_block(os8_file, block_no + RK05_RKB_OFFSET, block_buffer);
+    return write_dectape_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
 }
 
-bool read_dsk_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+bool write_rka_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
 {
-    /* It takes two bytes to make a 12-bit word ... */
-    byte_buffer_t byte_buffer;
-    int bytes = pread(os8_file, byte_buffer, OS8_BLOCK_SIZE * 2, block_no * OS8_BLOCK_SIZE * 2);
-    if (bytes != OS8_BLOCK_SIZE * 2) {
+    size_t length = (size_t)count * RK05_BLOCK_SIZE;
+    unsigned char *byte_buffer;
+
+    if ((byte_buffer = malloc(length)) == NULL) {
+        perror("malloc");
         return false;
     }
-    return byte_buffer_to_word_buffer(block_no, byte_buffer, block_buffer);
+
+    if (!pack_words(block_no, blocks[0], count * OS8_BLOCK_SIZE, byte_buffer)) {
+        free(byte_buffer);
+        return false;
+    }
+
+    ssize_t bytes = pwrite(os8_file, byte_buffer, length, (off_t)block_no * RK05_BLOCK_SIZE);
+    free(byte_buffer);
+    return bytes == (ssize_t)length;
 }
 
-bool read_dectape_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+bool write_rka_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
 {
-    byte_buffer_t byte_buffer;
+    return write_rka_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-    /* Unconverted simh DECTape files have 129 words per block of which 128 are used by OS/8 */
-    unsigned char *byte_ptr = byte_buffer;
-    unsigned byte_offset = block_no * DECTAPE_BLOCK_SIZE * 2;
+bool write_rkb_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    return write_rka_blocks(os8_file, block_no + RK05_RKB_OFFSET, count, blocks);
+}
 
-    do {
-        unsigned bytes = pread(os8_file, byte_ptr, OS8_BLOCK_SIZE, byte_offset);
-        if (bytes != OS8_BLOCK_SIZE) {
+bool write_rkb_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return write_rka_block(os8_file, block_no + RK05_RKB_OFFSET, block_buffer);
+}
+
+bool decode_dsk_blocks(unsigned block_no, unsigned count, unsigned char *byte_buffer,
+                       os8_block_t *blocks)
+{
+#if HOST_LITTLE_ENDIAN
+    memcpy(blocks, byte_buffer, (size_t)count * sizeof(os8_block_t));
+    return validate_words(block_no, count, blocks);
+#else
+    for (unsigned i = 0; i < count; i++) {
+        if (!byte_buffer_to_word_buffer(block_no + i, byte_buffer + i * OS8_BLOCK_SIZE * 2,
+                                        blocks[i])) {
             return false;
         }
-        byte_ptr += OS8_BLOCK_SIZE;
-        byte_offset += DECTAPE_BLOCK_SIZE;
-    } while (byte_ptr < byte_buffer + OS8_BLOCK_SIZE * 2);
-
-    return byte_buffer_to_word_buffer(block_no, byte_buffer, block_buffer);
+    }
+    return true;
+#endif
 }
 
-bool read_rka_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+bool read_dsk_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
 {
-    byte_buffer_t byte_buffer;
-    int bytes = pread(os8_file, byte_buffer, RK05_BLOCK_SIZE, block_no * RK05_BLOCK_SIZE);
-    if (bytes != RK05_BLOCK_SIZE) {
+    /* It takes two bytes to make a 12-bit word ... */
+    size_t length = (size_t)count * OS8_BLOCK_SIZE * 2;
+
+#if HOST_LITTLE_ENDIAN
+    /* ... which is exactly how we hold them in memory, so read straight into the caller's buffer */
+    ssize_t bytes = pread(os8_file, blocks, length, (off_t)block_no * OS8_BLOCK_SIZE * 2);
+    if (bytes != (ssize_t)length) {
         return false;
     }
-
-    unsigned char c1, c2, c3;
-    pdp8_word_t *block_ptr = &block_buffer[0];
-    unsigned char *buf_ptr = &byte_buffer[0];
-    do {
-        c1 = *buf_ptr++;
-        c2 = *buf_ptr++;
-        c3 = *buf_ptr++;
-        *block_ptr++ = (pdp8_word_t)((c1 << 4) | (c2 >> 4));
-        *block_ptr++ = (pdp8_word_t)(((c2 & 017) << 8) | c3);
-    } while (block_ptr < block_buffer + OS8_BLOCK_SIZE);
-
-    return true;
+    return validate_words(block_no, count, blocks);
+#else
+    unsigned char *byte_buffer;
+    if ((byte_buffer = malloc(length)) == NULL) {
+        perror("malloc");
+        return false;
+    }
+    ssize_t bytes = pread(os8_file, byte_buffer, length, (off_t)block_no * OS8_BLOCK_SIZE * 2);
+    bool ok = bytes == (ssize_t)length &&
+              decode_dsk_blocks(block_no, count, byte_buffer, blocks);
+    free(byte_buffer);
+    return ok;
+#endif
 }
 
-bool read_rkb_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+bool read_dsk_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
 {
-    return read_rka_block(os8_file, block_no + RK05_RKB_OFFSET, block_buffer);
+    return read_dsk_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
 }
 
-/* Read, write, and create directories */
-
-bool read_directory(block_io_t read_block, int os8_file, directory_t directory)
+/* Unconverted simh DECTape files have 129 words per block of which 128 are used by OS/8.
+   Read the whole run, garbage words and all, and pick out the OS/8 data.
+*/
+bool decode_dectape_blocks(unsigned block_no, unsigned count, unsigned char *byte_buffer,
+                           os8_block_t *blocks)
 {
-    int block_no = FIRST_DIR_BLOCK;
-
-    do {
-        if (!read_block(os8_file, block_no, directory[block_no - FIRST_DIR_BLOCK].d.data)) {
-            return false;
-        };
-        int i = block_no - FIRST_DIR_BLOCK;
-        directory[i].dirty = false;
-        block_no = directory[i].d.dir_struct.next_segment;
-        if (block_no > DIR_LENGTH) {
+    for (unsigned i = 0; i < count; i++) {
+        byte_buffer_t block_bytes;
+        unsigned char *byte_ptr = byte_buffer + i * DECTAPE_BLOCK_SIZE * 2;
+        memcpy(block_bytes, byte_ptr, OS8_BLOCK_SIZE);
+        memcpy(block_bytes + OS8_BLOCK_SIZE, byte_ptr + DECTAPE_BLOCK_SIZE, OS8_BLOCK_SIZE);
+        if (!byte_buffer_to_word_buffer(block_no + i, block_bytes, blocks[i])) {
             return false;
         }
-    } while (block_no != 0);
+    }
+    return true;
+}
 
-    if (!validate_directory(directory)) {
+bool read_dectape_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    size_t length = (size_t)count * DECTAPE_BLOCK_SIZE * 2;
+    unsigned char *byte_buffer;
+
+    if ((byte_buffer = malloc(length)) == NULL) {
+        perror("malloc");
         return false;
     }
 
+    ssize_t bytes = pread(os8_file, byte_buffer, length, (off_t)block_no * DECTAPE_BLOCK_SIZE * 2);
+    bool ok = bytes == (ssize_t)length &&
+              decode_dectape_blocks(block_no, count, byte_buffer, blocks);
+
+    free(byte_buffer);
+    return ok;
+}
+
+bool read_dectape_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return read_dectape_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
+
+/* Mac RK05 and packed-12 images, two words in three bytes */
+bool decode_packed_blocks(unsigned block_no, unsigned count, unsigned char *byte_buffer,
+                          os8_block_t *blocks)
+{
+    unpack_words(byte_buffer, blocks[0], count * OS8_BLOCK_SIZE);
     return true;
 }
 
-bool write_directory(block_io_t write_block, int os8_file, directory_t directory)
+bool read_rka_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
 {
+    size_t length = (size_t)count * RK05_BLOCK_SIZE;
+    unsigned char *byte_buffer;
 
-    if (!validate_directory(directory)) {
-        printf("Internal error, directory will not be written\n");
+    if ((byte_buffer = malloc(length)) == NULL) {
+        perror("malloc");
         return false;
     }
 
-    int block_no = FIRST_DIR_BLOCK;
+    ssize_t bytes = pread(os8_file, byte_buffer, length, (off_t)block_no * RK05_BLOCK_SIZE);
+    if (bytes != (ssize_t)length) {
+        free(byte_buffer);
+        return false;
+    }
 
-    do {
-        int i = block_no - FIRST_DIR_BLOCK;
-        if (directory[i].dirty) {
-            if ((directory[i].d.dir_struct.next_segment > DIR_LENGTH) ||
-                !write_block(os8_file, block_no, directory[block_no - FIRST_DIR_BLOCK].d.data)) {
-                printf("Error writing directory, directory may be corrupted\n");
-                return false;
-            }
-        };
-        directory[i].dirty = false;
-        block_no = directory[i].d.dir_struct.next_segment;
-    } while (block_no);
+    decode_packed_blocks(block_no, count, byte_buffer, blocks);
 
+    free(byte_buffer);
     return true;
 }
 
-bool get_device(device_t *device, format_t format)
+bool read_rka_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
 {
-    switch (format) {
-        case dectape:
-        case tu56:
-            device->last_block_no = DECTAPE_BLOCKS - 1;
-            device->filesystem_size = DECTAPE_BLOCKS - FIRST_DIR_BLOCK - DIR_LENGTH;
-            break;
-        case rk05:
-            device->last_block_no = RK05_RKB_OFFSET - 1;
-            device->filesystem_size = RK05_RKB_OFFSET - FIRST_DIR_BLOCK - DIR_LENGTH;
-            break;
-        default:
-            printf("Internal error: unsupported device format\n");
-            return false;
-    }   
-    device->size = device->last_block_no + 1;
-    return true;
+    return read_rka_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
 }
 
-/* Zero empties an existing filesystem, preserving the system blocks if it is a system
-   disk. Zero is a rubber mallet.
+bool read_rkb_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    return read_rka_blocks(os8_file, block_no + RK05_RKB_OFFSET, count, blocks);
+}
 
-   Create writes a new directory on the device file.  Create is a sledgehammer.
+bool read_rkb_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return read_rka_block(os8_file, block_no + RK05_RKB_OFFSET, block_buffer);
+}
 
-   Main program takes care of flushing the dirty directory blocks.
+/* simh RK05 images use the dsk layout for the whole pack.  OS/8's RK8E handler
+   splits the pack's 6496 blocks into two 3248 block filesystems with RKBn
+   following RKAn, so RKAn blocks are pack blocks and RKBn blocks are offset.
 */
+unsigned simh_rk05_pack_block(rk05_filesystem_t filesystem, unsigned block_no)
+{
+    return filesystem == rkb ? block_no + RK05_RKB_OFFSET : block_no;
+}
 
-bool zero_filesystem(directory_t directory, format_t format)
+bool read_simh_rka_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
 {
-    device_t device;
-    get_device(&device, format);
+    return read_dsk_blocks(os8_file, simh_rk05_pack_block(rka, block_no), count, blocks);
+}
 
-    directory[0].d.dir_struct.number_files = negate(1);
-    directory[0].d.dir_struct.next_segment = 0;
-    directory[0].d.dir_struct.flag_word = 0;
-    directory[0].d.dir_struct.file_entries[0] = 0; /* empty file */
-    directory[0].d.dir_struct.file_entries[1] =
-        negate(device.size - directory[0].d.dir_struct.first_file_block);
-    directory[0].dirty = true;
+bool read_simh_rka_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return read_simh_rka_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-    return true;
+bool read_simh_rkb_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    return read_dsk_blocks(os8_file, simh_rk05_pack_block(rkb, block_no), count, blocks);
 }
 
-bool create_filesystem(block_io_t write_block, int os8_file,
-                      directory_t directory, format_t format)
+bool read_simh_rkb_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
 {
+    return read_simh_rkb_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-    device_t device;
-    get_device(&device, format);
+bool write_simh_rka_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    return write_dsk_blocks(os8_file, simh_rk05_pack_block(rka, block_no), count, blocks);
+}
 
-    for (dir_block_t *block_ptr = directory; block_ptr < directory + DIR_LENGTH;
-         block_ptr++) {
-        block_ptr->dirty = false;
-        for (pdp8_word_t *data_ptr = block_ptr->d.data; data_ptr < block_ptr->d.data + OS8_BLOCK_SIZE;
-             data_ptr++) {
-            *data_ptr = 0;
-        }
-    }
+bool write_simh_rka_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return write_simh_rka_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-    directory[0].d.dir_struct.number_files = negate(1);
-    directory[0].d.dir_struct.first_file_block = DIR_LENGTH + 1;
-    directory[0].d.dir_struct.next_segment = 0;
-    directory[0].d.dir_struct.flag_word = 0;
-    directory[0].d.dir_struct.additional_words = negate(1);
-    directory[0].d.dir_struct.file_entries[1] = negate(device.filesystem_size);
+bool write_simh_rkb_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    return write_dsk_blocks(os8_file, simh_rk05_pack_block(rkb, block_no), count, blocks);
+}
 
-    if (!validate_directory(directory)) {
-        printf("Error validating directory after create?\n");
-        return false;
-    }
+bool write_simh_rkb_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return write_simh_rkb_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-    /* Write zero blocks in front of the directory. Though we know there's only one at zero,
-       generalizing it doesn't hurt anything and the compiler should figure it out.
-    */
+/* Both RK05 layouts have the same extension.  Our Mac PDP-8/e images are always
+   full length, anything longer or not a whole number of Mac blocks is simh's.
+*/
+format_t detect_rk05_format(off_t size)
+{
+    return size > RK05_LENGTH || (size != RK05_LENGTH && size % RK05_BLOCK_SIZE != 0) ?
+           simh_rk05 : rk05;
+}
 
-    for (unsigned block_no = 0; block_no < FIRST_DIR_BLOCK; block_no++) {
-        if (!write_block(os8_file, block_no, directory[1].d.data)) {
-            printf("Error zeroing device in create filesystem\n");
-            return false;
+/* RX01/RX02 sector mapping.  OS/8 numbers the sectors it uses consecutively, each
+   block taking four RX01 or two RX02 sectors.  The interleave and skew are the same
+   for both drives so the byte offset of every logical sector is computed once for
+   each sector size when the image is opened.
+*/
+typedef struct {
+    unsigned sector_size;
+    unsigned sector_words;
+    off_t sector_offset[RX_LOGICAL_SECTORS];
+} rx_geometry_t;
+
+static rx_geometry_t rx01_geometry = {RX01_SECTOR_SIZE, 64, {0}};
+static rx_geometry_t rx02_geometry = {RX02_SECTOR_SIZE, 128, {0}};
+
+void build_rx_geometry(rx_geometry_t *geometry)
+{
+    unsigned interleave[RX_SECTORS];
+    bool used[RX_SECTORS] = {false};
+    unsigned sector = 0;
+
+    for (unsigned i = 0; i < RX_SECTORS; i++) {
+        while (used[sector]) {
+            sector = (sector + 1) % RX_SECTORS;
         }
+        interleave[i] = sector;
+        used[sector] = true;
+        sector = (sector + RX_INTERLEAVE) % RX_SECTORS;
     }
 
-    /* write all of the directory blocks whether active or not when initializing */
-    for (unsigned block_no = 0; block_no < DIR_LENGTH; block_no++) {
-        if (!write_block(os8_file, block_no + FIRST_DIR_BLOCK,
-                         directory[block_no].d.data)) {
-            printf("Error writing initial directory in create filesystem\n");
-            return false;
-        }
+    for (unsigned logical = 0; logical < RX_LOGICAL_SECTORS; logical++) {
+        unsigned track = logical / RX_SECTORS + RX_FIRST_TRACK;
+        unsigned physical = (interleave[logical % RX_SECTORS] +
+                             (track - RX_FIRST_TRACK) * RX_TRACK_SKEW) % RX_SECTORS;
+        geometry->sector_offset[logical] =
+            ((off_t)track * RX_SECTORS + physical) * geometry->sector_size;
     }
+}
+
+/* Images may be opened on several threads at once */
+static pthread_once_t rx_geometry_once = PTHREAD_ONCE_INIT;
+
+void build_rx_geometries(void)
+{
+    build_rx_geometry(&rx01_geometry);
+    build_rx_geometry(&rx02_geometry);
+}
+
+/* A run of blocks lives on a run of whole tracks, which is what we transfer.
+   Returns false if the blocks aren't on the diskette.
+*/
+bool rx_track_span(rx_geometry_t *geometry, unsigned block_no, unsigned count,
+                   unsigned *first_sector, unsigned *sector_count, off_t *start, size_t *length)
+{
+    unsigned sectors_per_block = OS8_BLOCK_SIZE / geometry->sector_words;
 
-    /* now extend the file if necessary */
-    if (!write_block(os8_file, device.last_block_no, directory[1].d.data)) {
-        printf("Error extending device file in create filesystem\n");
+    *first_sector = block_no * sectors_per_block;
+    *sector_count = count * sectors_per_block;
+    if (*first_sector + *sector_count > RX_LOGICAL_SECTORS) {
         return false;
     }
 
+    unsigned first_track = *first_sector / RX_SECTORS + RX_FIRST_TRACK;
+    unsigned last_track = (*first_sector + *sector_count - 1) / RX_SECTORS + RX_FIRST_TRACK;
+    *start = (off_t)first_track * RX_SECTORS * geometry->sector_size;
+    *length = (size_t)(last_track - first_track + 1) * RX_SECTORS * geometry->sector_size;
     return true;
 }
 
-void print_directory(directory_t directory, long columns, const_str_t match_filename,
-                     bool print_empties_p)
+/* byte_buffer holds the whole tracks of the blocks */
+bool decode_rx_blocks(rx_geometry_t *geometry, unsigned block_no, unsigned count,
+                      unsigned char *byte_buffer, os8_block_t *blocks)
 {
-    cursor_t cursor;
-    entry_t entry;
-    long column = 0;
-    pdp8_word_t files = 0;
-    pdp8_word_t used = 0;
-    pdp8_word_t empty = 0;
-    pattern_t pattern;
-
-    build_pattern(match_filename, &pattern);
+    unsigned first_sector, sector_count;
+    off_t start;
+    size_t length;
 
-    init_cursor(directory, &cursor);
-    while (valid_entry(&cursor)) {
-        get_entry(&cursor, &entry);
-        if (entry.empty_file) {
-            empty += entry.length;
-        }
-        if (entry.empty_file && print_empties_p) {
-            printf("%-11s", "<empty>");
-        } else if (!entry.empty_file && entry.length != 0 && 
-                   pattern_match_p(entry.name, pattern)) {
-            os8_filename_t filename;
-            get_filename(entry.name, filename);
-            printf("%-11s", filename);
-            used += entry.length;
-            files++;
-        } else {
-            continue;
-        }
-        column++;
-        printf("%5d", entry.length);
-        if (column % columns != 0) {
-            printf("%10s", " ");
-        } else {
-            putchar('\n');
-        }
-    }
-    if (column % columns != 0) {
-        putchar('\n');
+    if (!rx_track_span(geometry, block_no, count, &first_sector, &sector_count, &start, &length)) {
+        return false;
     }
-    printf("\n  %d Files In %d Blocks - %d Free Blocks\n", files, used, empty);
-}
 
-void delete_entry(entry_t *entry)
-{
-    /* scrunch the directory segment down to the end of the new
-       entry, accounting for the fact that we didn't remove the
-       file but will be changing it to an empty file.  The
-       order here is important.
-    */
-    fix_segment_down(*entry, EMPTY_ENTRY_LENGTH);
-    entry->empty_file = true; 
-    put_entry(*entry);        
+    pdp8_word_t *word_ptr = blocks[0];
+    for (unsigned i = 0; i < sector_count; i++) {
+        unpack_words(byte_buffer + (geometry->sector_offset[first_sector + i] - start),
+                     word_ptr, geometry->sector_words);
+        word_ptr += geometry->sector_words;
+    }
+    return true;
 }
 
-/*
-  Makes a new OS/8 file.  It will delete the old one and return an
-  entry for an empty file that's at least as large as the size requested.
-
-  It allows one to request the largest available block by passing zero as
-  the size, just like OS/8, but this program doesn't use this.
-
-  Don't write more blocks than are contained in the empty file entry that
-  is returned!
-
-*/
-
-bool allocate_os8_file(char *filename, unsigned size, directory_t directory, entry_t *entry)
+bool read_rx_blocks(rx_geometry_t *geometry, int os8_file, unsigned block_no, unsigned count,
+                    os8_block_t *blocks)
 {
-    entry_t exclude_entry = {0};
-    cursor_t cursor;
+    unsigned first_sector, sector_count;
+    off_t start;
+    size_t length;
+    unsigned char *byte_buffer;
 
-    init_cursor(directory, &cursor);
-    if (lookup(filename, directory, &cursor, &exclude_entry)) {
-        delete_entry(&exclude_entry);
+    if (!rx_track_span(geometry, block_no, count, &first_sector, &sector_count, &start, &length)) {
+        return false;
+    }
+    if ((byte_buffer = malloc(length)) == NULL) {
+        perror("malloc");
+        return false;
     }
 
-    return get_empty_entry(directory, exclude_entry, entry, size);
-}
-
-/* You must call this with the entry passed back by get_empty_file */
+    ssize_t bytes = pread(os8_file, byte_buffer, length, start);
+    bool ok = bytes == (ssize_t)length &&
+              decode_rx_blocks(geometry, block_no, count, byte_buffer, blocks);
 
-bool enter_os8_file(char *filename, unsigned size, directory_t directory, entry_t entry)
-{
-    if (enter(filename, size, directory, entry)) {
-        consolidate(directory);
-        return true;
-    }
-    return false;
+    free(byte_buffer);
+    return ok;
 }
 
-
-bool stream_host_image_file(FILE *input, int os8_file, block_io_t write_block,
-                            directory_t directory, char *outputname, unsigned size)
+/* The sectors of a block aren't adjacent, so rewrite the tracks they live on */
+bool write_rx_blocks(rx_geometry_t *geometry, int os8_file, unsigned block_no, unsigned count,
+                     os8_block_t *blocks)
 {
-    os8_block_t block;
+    unsigned first_sector, sector_count;
+    off_t start;
+    size_t length;
+    unsigned char *byte_buffer;
 
-    /* Compute size for get_empty_entry */
-    unsigned output_size = (size + (OS8_BLOCK_SIZE - 1) * 2)  /
-                           (OS8_BLOCK_SIZE * 2);
-    entry_t entry;
-    if (!allocate_os8_file(outputname, output_size, directory, &entry)) {
+    if (!rx_track_span(geometry, block_no, count, &first_sector, &sector_count, &start, &length)) {
+        return false;
+    }
+    if ((byte_buffer = calloc(length, 1)) == NULL) {
+        perror("calloc");
         return false;
     }
 
-    unsigned block_no = 0;
-    int cnt;
-    while ((cnt = fread(block, 2, OS8_BLOCK_SIZE, input)) > 0) {
+    /* a short read just leaves zeros, the diskette image is being created */
+    if (pread(os8_file, byte_buffer, length, start) == -1) {
+        free(byte_buffer);
+        return false;
+    }
 
-        /* should never happen */
-        if (block_no >= entry.length) {
+    pdp8_word_t *word_ptr = blocks[0];
+    for (unsigned i = 0; i < sector_count; i++) {
+        if (!pack_words(block_no + i / (OS8_BLOCK_SIZE / geometry->sector_words), word_ptr,
+                        geometry->sector_words,
+                        byte_buffer + (geometry->sector_offset[first_sector + i] - start))) {
+            free(byte_buffer);
             return false;
         }
+        word_ptr += geometry->sector_words;
+    }
 
-        /* zero out the rest of te  block to avoid "data corrupted" message */
-        for (pdp8_word_t *p = block + cnt; p < block + OS8_BLOCK_SIZE;) {
-           *p++ = 0;
-        } 
+    ssize_t bytes = pwrite(os8_file, byte_buffer, length, start);
+    free(byte_buffer);
+    return bytes == (ssize_t)length;
+}
 
-        if (!write_block(os8_file, entry.file_block + block_no, block)) {
-            return false;
-        }
-        block_no++;
-    }
+bool decode_rx01_blocks(unsigned block_no, unsigned count, unsigned char *byte_buffer,
+                        os8_block_t *blocks)
+{
+    return decode_rx_blocks(&rx01_geometry, block_no, count, byte_buffer, blocks);
+}
 
-    return enter_os8_file(outputname, block_no, directory, entry);
+bool read_rx01_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    return read_rx_blocks(&rx01_geometry, os8_file, block_no, count, blocks);
 }
 
-/* helper for stream_host_text_file since we output <cr> chars before
-   <lf> chars in most cases.
-*/
+bool read_rx01_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return read_rx01_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-static int host_char_cnt = 0;
+bool write_rx01_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    return write_rx_blocks(&rx01_geometry, os8_file, block_no, count, blocks);
+}
 
-bool put_host_char(FILE *t, pdp8_word_t ch)
+bool write_rx01_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
 {
-    static pdp8_word_t w[2];
+    return write_rx01_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-    switch (host_char_cnt % 3) {
-    case 0:
-        w[0] = ch;
-        break;
-    case 1:
-        w[1] = ch;
-        break;
-    case 2:
-        w[0] |= (ch & 0360) << 4;
-        w[1] |= (ch & 017) << 8;
-        if (fwrite(w, sizeof(pdp8_word_t), 2, t) != 2) {
-            perror("error writing temp file");
-            return false;
-        }
-        break;
-    }
-    host_char_cnt++;
-    return true;
+bool decode_rx02_blocks(unsigned block_no, unsigned count, unsigned char *byte_buffer,
+                        os8_block_t *blocks)
+{
+    return decode_rx_blocks(&rx02_geometry, block_no, count, byte_buffer, blocks);
 }
 
-/* This function streams to a temp file, then calls stream_host_image_file
-   to write the result to the OS/8 device file.  We do this because we'll
-   add <cr>s in front of newlines, which  makes the file longer, which means
-   that you can't use the size of the input file to ask for an emply slot
-   on the OS/8 filesystem.
-*/
-bool stream_host_text_file(FILE *input, int os8_file, block_io_t write_block,
-                            directory_t directory, char *outputname)
+bool read_rx02_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
 {
-    struct stat stat_buf;
-    FILE *t = tmpfile();
+    return read_rx_blocks(&rx02_geometry, os8_file, block_no, count, blocks);
+}
 
-    int c;
-    bool ctrl_z_seen;
-    host_char_cnt = 0;
-    bool first_lf = true;
+bool read_rx02_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return read_rx02_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-    while ((c = fgetc(input)) != EOF && !ctrl_z_seen) {
-        ctrl_z_seen = c == '\032';
-        if (c == '\012'  && first_lf) {
-            if (!put_host_char(t, 0215)) {
-                return false;
-            }
-        }
-        first_lf = (c != '\012') && (c != '\015');
-        if (c != '\0') {
-            if (!put_host_char(t, c | 0200)) { /* always set the mark bit */
-                return false;
-            }
-        }
-    }
+bool write_rx02_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    return write_rx_blocks(&rx02_geometry, os8_file, block_no, count, blocks);
+}
 
-    /* OS/8 will be very unhappy without its ^Z at the end */
-    if (!ctrl_z_seen) {
-        if (!put_host_char(t, 0232)) {
-            return false;
-        }
-    }
+bool write_rx02_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return write_rx02_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-    /* flush partial output */
-    if (!put_host_char(t, 0)) {
+/* Packed-12 header layout: magic, version, original format code, two reserved bytes
+   and the block count, little-endian.  The whole device is stored, both filesystems
+   of an RK05 pack included.
+*/
+typedef struct {
+    format_t format;
+    unsigned blocks;
+} packed12_header_t;
+
+static const struct {
+    format_t format;
+    char code;
+} packed12_formats[] = {
+    {dectape, 't'},
+    {dsk, 'd'},
+    {rk05, 'k'},
+    {simh_rk05, 's'},
+    {rx01, '1'},
+    {rx02, '2'},
+    {unknown, '\0'}
+};
+
+bool read_packed12_header(int os8_file, packed12_header_t *header)
+{
+    unsigned char bytes[PACKED12_HEADER_SIZE];
+
+    if (pread(os8_file, bytes, PACKED12_HEADER_SIZE, 0) != PACKED12_HEADER_SIZE ||
+        memcmp(bytes, PACKED12_MAGIC, strlen(PACKED12_MAGIC)) != 0) {
+        printf("Not a packed-12 image\n");
         return false;
     }
-    if (!put_host_char(t, 0)) {
+    if (bytes[8] != PACKED12_VERSION) {
+        printf("Unsupported packed-12 image version %d\n", bytes[8]);
         return false;
     }
 
-    fflush(t);
-    fseek(t, 0, SEEK_SET);
-
-    if (fstat(fileno(t), &stat_buf) == -1) {
-        perror("stat");
-        return false;
+    header->format = unknown;
+    for (int i = 0; packed12_formats[i].format != unknown; i++) {
+        if (packed12_formats[i].code == (char)bytes[9]) {
+            header->format = packed12_formats[i].format;
+        }
     }
+    header->blocks = bytes[12] | bytes[13] << 8 | bytes[14] << 16 | (unsigned)bytes[15] << 24;
 
-    if (!stream_host_image_file(t, os8_file,  write_block, directory,
-                                outputname, stat_buf.st_size)) {
+    if (header->format == unknown) {
+        printf("Packed-12 image has an unknown original format\n");
         return false;
     }
-
-    fclose(t);
-
     return true;
 }
 
-/* This works like stream_host_text_file, but without diddling characters.
-   It doesn't really need to write to a temp file as it does and this is
-   a bit inefficient, but allows it to borrow code from the former.  In
-   fact they could be rolled into one but I'm too lazy to do it.
-*/
-bool stream_host_binary_file(FILE *input, int os8_file, block_io_t write_block,
-                            directory_t directory, char *outputname)
+bool write_packed12_header(int os8_file, packed12_header_t header)
 {
-    struct stat stat_buf;
-    FILE *t = tmpfile();
-
-    int c;
-    host_char_cnt = 0;
-    bool ctrl_z_seen;
+    unsigned char bytes[PACKED12_HEADER_SIZE] = {0};
 
-    while ((c = fgetc(input)) != EOF && !ctrl_z_seen) {
-        c &= 0377;
-        ctrl_z_seen = c == 0232;
-        if (!put_host_char(t, c)) {
-            return false;
+    memcpy(bytes, PACKED12_MAGIC, strlen(PACKED12_MAGIC));
+    bytes[8] = PACKED12_VERSION;
+    for (int i = 0; packed12_formats[i].format != unknown; i++) {
+        if (packed12_formats[i].format == header.format) {
+            bytes[9] = packed12_formats[i].code;
         }
     }
+    bytes[12] = header.blocks & 0377;
+    bytes[13] = (header.blocks >> 8) & 0377;
+    bytes[14] = (header.blocks >> 16) & 0377;
+    bytes[15] = (header.blocks >> 24) & 0377;
 
-    /* OS/8 will be very unhappy without its ^Z at the end */
-    if (!ctrl_z_seen) {
-        if (!put_host_char(t, 0232)) {
-            return false;
-        }
-    }
+    return pwrite(os8_file, bytes, PACKED12_HEADER_SIZE, 0) == PACKED12_HEADER_SIZE;
+}
 
-    /* flush partial output */
-    if (!put_host_char(t, 0)) {
+bool read_packed12_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    size_t length = (size_t)count * RK05_BLOCK_SIZE;
+    unsigned char *byte_buffer;
+
+    if ((byte_buffer = malloc(length)) == NULL) {
+        perror("malloc");
         return false;
     }
-    if (!put_host_char(t, 0)) {
+
+    ssize_t bytes = pread(os8_file, byte_buffer, length,
+                          PACKED12_HEADER_SIZE + (off_t)block_no * RK05_BLOCK_SIZE);
+    if (bytes != (ssize_t)length) {
+        free(byte_buffer);
         return false;
     }
+    decode_packed_blocks(block_no, count, byte_buffer, blocks);
 
-    fflush(t);
-    fseek(t, 0, SEEK_SET);
+    free(byte_buffer);
+    return true;
+}
 
-    if (fstat(fileno(t), &stat_buf) == -1) {
-        perror("stat");
+bool read_packed12_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return read_packed12_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
+
+bool write_packed12_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    size_t length = (size_t)count * RK05_BLOCK_SIZE;
+    unsigned char *byte_buffer;
+
+    if ((byte_buffer = malloc(length)) == NULL) {
+        perror("malloc");
         return false;
     }
 
-    if (!stream_host_image_file(t, os8_file,  write_block, directory,
-                                outputname, stat_buf.st_size)) {
+    if (!pack_words(block_no, blocks[0], count * OS8_BLOCK_SIZE, byte_buffer)) {
+        free(byte_buffer);
         return false;
     }
 
-    fclose(t);
+    ssize_t bytes = pwrite(os8_file, byte_buffer, length,
+                           PACKED12_HEADER_SIZE + (off_t)block_no * RK05_BLOCK_SIZE);
+    free(byte_buffer);
+    return bytes == (ssize_t)length;
+}
 
-    return true;
+bool write_packed12_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return write_packed12_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
 }
 
-bool stream_os8_image_file(entry_t entry, int os8_file,
-                          block_io_t read_block, FILE *output)
+/* packed-12 images of RK05 packs hold both filesystems */
+bool read_packed12_rkb_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
 {
-    os8_block_t block;
-    bool eof_p = false;
-    unsigned cnt = 0;
+    return read_packed12_blocks(os8_file, block_no + RK05_RKB_OFFSET, count, blocks);
+}
 
-    for (pdp8_word_t block_no = entry.file_block;
-        block_no < entry.file_block + entry.length;
-        block_no++) {
-        if (!read_block(os8_file, block_no, block)) {
-            return false;
-        }
-        if ((cnt = fwrite(block, 2, OS8_BLOCK_SIZE, output)) != OS8_BLOCK_SIZE) {
-            return false;
-        }
-    }
+bool read_packed12_rkb_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
+{
+    return read_packed12_rkb_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-    return true;
+bool write_packed12_rkb_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    return write_packed12_blocks(os8_file, block_no + RK05_RKB_OFFSET, count, blocks);
 }
 
-bool stream_os8_byte_file(entry_t entry, filename_type_t type, int os8_file,
-                          block_io_t read_block, FILE *output)
+bool write_packed12_rkb_block(int os8_file, unsigned block_no, os8_block_t block_buffer)
 {
-    os8_block_t block;
-    bool eof_p = false;
-    pdp8_word_t block_no = entry.file_block;
-    unsigned cnt = 0;
-    pdp8_word_t mask = type == text_type ? 0177 : 0377;
- 
-    while (!eof_p) {
-        char ch;
-        if (!read_block(os8_file, block_no, block)) {
-            return false;
-        }
+    return write_packed12_rkb_blocks(os8_file, block_no, 1, (os8_block_t *)block_buffer);
+}
 
-        /* unpack one block, stripping the mark bit, ignoring nulls and rubouts, etc */
-        pdp8_word_t *block_ptr = block;
-        while (!eof_p && block_ptr < block + OS8_BLOCK_SIZE) {
-            switch (cnt % 3) {
-            case 0:
-                ch = *block_ptr & mask;
-                break;
-            case 1:
-                ch = *(block_ptr + 1) & mask;
-                break;
-            case 2:
-                ch = ((*block_ptr >> 4) & (mask & 0360)) | *(block_ptr + 1) >> 8;
-                block_ptr += 2;
-                break;
-            }
-            if (type == text_type) {
-                if (ch != 0177 &&
-                    ch != 015 &&
-                    ch != 0 &&
-                    ch != 032) {
-                        putc(ch, output);
-                    }
-                   eof_p = ch == 032;
-            } else {
-                putc(ch, output);
-            }
-            cnt++;
-        }
-        block_no++;
-        eof_p |= block_no == entry.file_block + entry.length;
-    }
-    return true;
+/* Where a run of blocks lives in the image file, for the things that deal with the
+   file rather than its contents: finding holes, advising the kernel and so on.
+*/
+typedef void (*span_t)(unsigned, unsigned, off_t *, off_t *);
+
+void dsk_span(unsigned block_no, unsigned count, off_t *start, off_t *end)
+{
+    *start = (off_t)block_no * OS8_BLOCK_SIZE * 2;
+    *end = *start + (off_t)count * OS8_BLOCK_SIZE * 2;
 }
 
-/* command line processor will only call this for an OS/8 text file */
-bool print_os8_text_file(const_str_t filename, int os8_file,
-                    block_io_t read_block, directory_t directory)
+void dectape_span(unsigned block_no, unsigned count, off_t *start, off_t *end)
 {
-    cursor_t cursor;
-    entry_t entry;
-    init_cursor(directory, &cursor);
-    if (lookup(filename, directory, &cursor, &entry)) {
-        return stream_os8_byte_file(entry, text_type, os8_file, read_block, stdout);
-    }
-    printf("OS/8 file not found\n");
-    return false;
+    *start = (off_t)block_no * DECTAPE_BLOCK_SIZE * 2;
+    *end = *start + (off_t)count * DECTAPE_BLOCK_SIZE * 2;
 }
-bool copy_os8_files(char **argv, int first, int last, int os8_file,
-                    block_io_t read_block, directory_t directory)
 
-/* We are guaranteed that the last file is a path to an existing host directory
-   for a possibly non-existing file, and that the first through last-1 files are
-   all OS/8 file names.
-*/
+void rka_span(unsigned block_no, unsigned count, off_t *start, off_t *end)
 {
-    int fd;
-    struct stat stat_buf;
-    bool is_dir_p;
+    *start = (off_t)block_no * RK05_BLOCK_SIZE;
+    *end = *start + (off_t)count * RK05_BLOCK_SIZE;
+}
 
-    if ((fd = open(argv[last], O_RDONLY)) != -1) {
-        if (fstat(fd, &stat_buf) == -1) {
-            perror("stat");
-            return false;
-        }
-        is_dir_p = S_ISDIR(stat_buf.st_mode);
-    }
+void rkb_span(unsigned block_no, unsigned count, off_t *start, off_t *end)
+{
+    rka_span(block_no + RK05_RKB_OFFSET, count, start, end);
+}
 
-    /* We will only copy multiple files to a directory, just like the "cp" command
-       in Unix-like systems.  If there is a single source file which contains wildcard
-       characters we assume it will match multiple files.
-    */
+void simh_rkb_span(unsigned block_no, unsigned count, off_t *start, off_t *end)
+{
+    dsk_span(simh_rk05_pack_block(rkb, block_no), count, start, end);
+}
 
-    if ((last - first > 1 ||
-         (last - first == 1 && os8_contains_wildcard_p(argv[first]))) &&
-        !is_dir_p) {
-        printf("Output file must be an existing host directory\n");
-        return false;
+void rx_span(rx_geometry_t *geometry, unsigned block_no, unsigned count, off_t *start, off_t *end)
+{
+    unsigned first_sector, sector_count;
+    size_t length;
+
+    if (!rx_track_span(geometry, block_no, count, &first_sector, &sector_count, start, &length)) {
+        length = 0;
     }
+    *end = *start + length;
+}
 
-    close(fd);
+void rx01_span(unsigned block_no, unsigned count, off_t *start, off_t *end)
+{
+    rx_span(&rx01_geometry, block_no, count, start, end);
+}
 
-    for (int i = first; i < last; i++) {
-        cursor_t cursor;
-        entry_t entry;
+void rx02_span(unsigned block_no, unsigned count, off_t *start, off_t *end)
+{
+    rx_span(&rx02_geometry, block_no, count, start, end);
+}
 
-        init_cursor(directory, &cursor);
+void packed12_span(unsigned block_no, unsigned count, off_t *start, off_t *end)
+{
+    *start = PACKED12_HEADER_SIZE + (off_t)block_no * RK05_BLOCK_SIZE;
+    *end = *start + (off_t)count * RK05_BLOCK_SIZE;
+}
+
+void packed12_rkb_span(unsigned block_no, unsigned count, off_t *start, off_t *end)
+{
+    packed12_span(block_no + RK05_RKB_OFFSET, count, start, end);
+}
+
+typedef struct {
+    block_io_t read_block;
+    block_io_t write_block;
+    blocks_io_t read_blocks;
+    blocks_io_t write_blocks;
+    span_t span;
+    decode_t decode;
+} codec_t;
+
+/* Pick the readers and writers for an image format.  The rkb filesystem is only
+   meaningful for RK05 packs, base and rka give the whole device.
+*/
+bool get_codec(format_t format, rk05_filesystem_t filesystem, codec_t *codec)
+{
+    switch (format) {
+    case dsk:
+        *codec = (codec_t){&read_dsk_block, &write_dsk_block,
+                           &read_dsk_blocks, &write_dsk_blocks, &dsk_span,
+                           &decode_dsk_blocks};
+        break;
+
+    case rk05:
+        if (filesystem == rkb) {
+            *codec = (codec_t){&read_rkb_block, &write_rkb_block,
+                               &read_rkb_blocks, &write_rkb_blocks, &rkb_span,
+                               &decode_packed_blocks};
+        } else {
+            *codec = (codec_t){&read_rka_block, &write_rka_block,
+                               &read_rka_blocks, &write_rka_blocks, &rka_span,
+                               &decode_packed_blocks};
+        }
+        break;
+
+    case simh_rk05:
+        if (filesystem == rkb) {
+            *codec = (codec_t){&read_simh_rkb_block, &write_simh_rkb_block,
+                               &read_simh_rkb_blocks, &write_simh_rkb_blocks, &simh_rkb_span,
+                               &decode_dsk_blocks};
+        } else {
+            *codec = (codec_t){&read_simh_rka_block, &write_simh_rka_block,
+                               &read_simh_rka_blocks, &write_simh_rka_blocks, &dsk_span,
+                               &decode_dsk_blocks};
+        }
+        break;
+
+    case rx01:
+        pthread_once(&rx_geometry_once, &build_rx_geometries);
+        *codec = (codec_t){&read_rx01_block, &write_rx01_block,
+                           &read_rx01_blocks, &write_rx01_blocks, &rx01_span,
+                           &decode_rx01_blocks};
+        break;
+
+    case rx02:
+        pthread_once(&rx_geometry_once, &build_rx_geometries);
+        *codec = (codec_t){&read_rx02_block, &write_rx02_block,
+                           &read_rx02_blocks, &write_rx02_blocks, &rx02_span,
+                           &decode_rx02_blocks};
+        break;
+
+    case packed12:
+        if (filesystem == rkb) {
+            *codec = (codec_t){&read_packed12_rkb_block, &write_packed12_rkb_block,
+                               &read_packed12_rkb_blocks, &write_packed12_rkb_blocks,
+                               &packed12_rkb_span, &decode_packed_blocks};
+        } else {
+            *codec = (codec_t){&read_packed12_block, &write_packed12_block,
+                               &read_packed12_blocks, &write_packed12_blocks, &packed12_span,
+                               &decode_packed_blocks};
+        }
+        break;
+
+    case dectape:
+    case tu56:
+        *codec = (codec_t){&read_dectape_block, &write_dectape_block,
+                           &read_dectape_blocks, &write_dectape_blocks, &dectape_span,
+                           &decode_dectape_blocks};
+        break;
+
+    default:
+        printf("internal error\n");
+        return false;
+    }
+    return true;
+}
+
+format_t format_from_extension(const_str_t filename)
+{
+    const_str_t dot_pos;
+
+    if ((dot_pos = strrchr(filename, '.')) != NULL) {
+        if (strcmp(dot_pos, ".tu56") == 0 || strcmp(dot_pos, ".dt8") == 0) {
+            return dectape;
+        } else if (strcmp(dot_pos, ".dsk") == 0) {
+            return dsk;
+        } else if (strcmp(dot_pos, ".rk05") == 0) {
+            return rk05;
+        } else if (strcmp(dot_pos, ".rx01") == 0) {
+            return rx01;
+        } else if (strcmp(dot_pos, ".rx02") == 0) {
+            return rx02;
+        } else if (strcmp(dot_pos, ".p12") == 0) {
+            return packed12;
+        }
+    }
+    return unknown;
+}
+
+/* Read, write, and create directories */
+
+/* Copy the directory region into the directory, returning false if the segment
+   chain starting at FIRST_DIR_BLOCK is malformed.  Segments that aren't part of
+   the chain are copied too so they are sane if enter needs to add a segment.
+*/
+bool load_directory(os8_block_t *blocks, directory_t directory)
+{
+    for (int i = 0; i < DIR_LENGTH; i++) {
+        memcpy(directory[i].d.data, blocks[i], sizeof(os8_block_t));
+        directory[i].dirty = false;
+    }
+
+    int block_no = FIRST_DIR_BLOCK;
+    int segments = 0;
+
+    do {
+        block_no = directory[block_no - FIRST_DIR_BLOCK].d.dir_struct.next_segment;
+        if (block_no > DIR_LENGTH || ++segments > DIR_LENGTH) {
+            return false;
+        }
+    } while (block_no != 0);
+
+    return true;
+}
+
+bool read_directory(blocks_io_t read_blocks, int os8_file, directory_t directory)
+{
+    os8_block_t blocks[DIR_LENGTH];
+
+    /* The directory lives in a fixed region so we read all of it at once and walk
+       the segment chain in memory.  Segments that aren't in the chain may hold
+       anything at all, so if the bulk read is rejected fall back to reading just
+       the segments in the chain, and only complain about those.
+    */
+    bool quiet_p = corruption_quiet_p;
+    corruption_quiet_p = true;
+    bool bulk_p = read_blocks(os8_file, FIRST_DIR_BLOCK, DIR_LENGTH, blocks);
+    corruption_quiet_p = quiet_p;
+
+    if (!bulk_p) {
+        int block_no = FIRST_DIR_BLOCK;
+        int segments = 0;
+
+        memset(blocks, 0, sizeof(blocks));
+        do {
+            int i = block_no - FIRST_DIR_BLOCK;
+            if (!read_blocks(os8_file, block_no, 1, &blocks[i])) {
+                return false;
+            }
+            block_no = blocks[i][offsetof(dir_struct_t, next_segment) / sizeof(pdp8_word_t)];
+            if (block_no > DIR_LENGTH || ++segments > DIR_LENGTH) {
+                return false;
+            }
+        } while (block_no != 0);
+    }
+
+    if (!load_directory(blocks, directory)) {
+        return false;
+    }
+
+    if (!validate_directory(directory)) {
+        return false;
+    }
+
+    return true;
+}
+
+/* Write out a run of consecutive dirty directory segments with one write */
+bool write_directory_run(blocks_io_t write_blocks, int os8_file, directory_t directory,
+                         os8_block_t *blocks, int run_start, int run_length)
+{
+    if (run_length == 0) {
+        return true;
+    }
+    if (!write_blocks(os8_file, run_start, run_length, blocks)) {
+        printf("Error writing directory, directory may be corrupted\n");
+        return false;
+    }
+    for (int i = 0; i < run_length; i++) {
+        directory[run_start - FIRST_DIR_BLOCK + i].dirty = false;
+    }
+    return true;
+}
+
+bool write_directory(blocks_io_t write_blocks, int os8_file, directory_t directory)
+{
+
+    if (!validate_directory(directory)) {
+        printf("Internal error, directory will not be written\n");
+        return false;
+    }
+
+    /* OS/8 allocates segments in order so the dirty segments are usually adjacent
+       on the device and can be written in one go.
+    */
+    os8_block_t blocks[DIR_LENGTH];
+    int run_start = 0;
+    int run_length = 0;
+    int block_no = FIRST_DIR_BLOCK;
+
+    do {
+        int i = block_no - FIRST_DIR_BLOCK;
+        if (directory[i].d.dir_struct.next_segment > DIR_LENGTH) {
+            printf("Error writing directory, directory may be corrupted\n");
+            return false;
+        }
+        if (directory[i].dirty) {
+            if (run_length != 0 && run_start + run_length != block_no) {
+                if (!write_directory_run(write_blocks, os8_file, directory, blocks,
+                                         run_start, run_length)) {
+                    return false;
+                }
+                run_length = 0;
+            }
+            if (run_length == 0) {
+                run_start = block_no;
+            }
+            memcpy(blocks[run_length++], directory[i].d.data, sizeof(os8_block_t));
+        }
+        block_no = directory[i].d.dir_struct.next_segment;
+    } while (block_no);
+
+    return write_directory_run(write_blocks, os8_file, directory, blocks, run_start, run_length);
+}
+
+/* dsk_blocks gives the size of a dsk image, which isn't implied by its format */
+bool get_device(device_t *device, format_t format, unsigned dsk_blocks)
+{
+    switch (format) {
+        case dectape:
+        case tu56:
+            device->last_block_no = DECTAPE_BLOCKS - 1;
+            device->filesystem_size = DECTAPE_BLOCKS - FIRST_DIR_BLOCK - DIR_LENGTH;
+            device->image_size = DECTAPE_LENGTH;
+            break;
+        case dsk:
+            if (dsk_blocks <= FIRST_DIR_BLOCK + DIR_LENGTH || dsk_blocks > DSK_MAX_BLOCKS) {
+                printf("dsk images must be between %d and %d blocks long\n",
+                       FIRST_DIR_BLOCK + DIR_LENGTH + 1, DSK_MAX_BLOCKS);
+                return false;
+            }
+            device->last_block_no = dsk_blocks - 1;
+            device->filesystem_size = dsk_blocks - FIRST_DIR_BLOCK - DIR_LENGTH;
+            device->image_size = (off_t)dsk_blocks * OS8_BLOCK_SIZE * 2;
+            break;
+        case rk05:
+        case simh_rk05:
+            device->last_block_no = RK05_RKB_OFFSET - 1;
+            device->filesystem_size = RK05_RKB_OFFSET - FIRST_DIR_BLOCK - DIR_LENGTH;
+            /* both platters, whichever one we're working on */
+            device->image_size = format == rk05 ? RK05_LENGTH : SIMH_RK05_LENGTH;
+            break;
+        case rx01:
+        case rx02:
+            device->last_block_no = (format == rx01 ? RX01_BLOCKS : RX02_BLOCKS) - 1;
+            device->filesystem_size = device->last_block_no + 1 - FIRST_DIR_BLOCK - DIR_LENGTH;
+            device->image_size = format == rx01 ? RX01_LENGTH : RX02_LENGTH;
+            break;
+        default:
+            printf("Internal error: unsupported device format\n");
+            return false;
+    }   
+    device->size = device->last_block_no + 1;
+    return true;
+}
+
+/* A packed-12 image's filesystem is shaped like the device it holds */
+bool get_packed12_device(device_t *device, packed12_header_t header)
+{
+    if (!get_device(device, header.format, header.blocks)) {
+        return false;
+    }
+    device->image_size = PACKED12_HEADER_SIZE + (off_t)header.blocks * RK05_BLOCK_SIZE;
+    return true;
+}
+
+/* The number of OS/8 blocks in a whole device, counting both filesystems of an
+   RK05 pack.  Only dsk images need the image file size.
+*/
+unsigned device_blocks(format_t format, off_t size)
+{
+    switch (format) {
+    case dectape:
+    case tu56:
+        return DECTAPE_BLOCKS;
+    case rk05:
+    case simh_rk05:
+        return RK05_RKB_OFFSET * 2;
+    case rx01:
+        return RX01_BLOCKS;
+    case rx02:
+        return RX02_BLOCKS;
+    default:
+        return size / (OS8_BLOCK_SIZE * 2);
+    }
+}
+
+/* Zero empties an existing filesystem, preserving the system blocks if it is a system
+   disk. Zero is a rubber mallet.
+
+   Create writes a new directory on the device file.  Create is a sledgehammer.
+
+   Main program takes care of flushing the dirty directory blocks.
+*/
+
+bool zero_filesystem(directory_t directory, device_t device)
+{
+    directory[0].d.dir_struct.number_files = negate(1);
+    directory[0].d.dir_struct.next_segment = 0;
+    directory[0].d.dir_struct.flag_word = 0;
+    directory[0].d.dir_struct.file_entries[0] = 0; /* empty file */
+    directory[0].d.dir_struct.file_entries[1] =
+        negate(device.size - directory[0].d.dir_struct.first_file_block);
+    directory[0].dirty = true;
+
+    return true;
+}
+
+bool create_filesystem(blocks_io_t write_blocks, int os8_file,
+                      directory_t directory, device_t device)
+{
+    struct stat stat_buf;
+
+    for (dir_block_t *block_ptr = directory; block_ptr < directory + DIR_LENGTH;
+         block_ptr++) {
+        block_ptr->dirty = false;
+        for (pdp8_word_t *data_ptr = block_ptr->d.data; data_ptr < block_ptr->d.data + OS8_BLOCK_SIZE;
+             data_ptr++) {
+            *data_ptr = 0;
+        }
+    }
+
+    directory[0].d.dir_struct.number_files = negate(1);
+    directory[0].d.dir_struct.first_file_block = DIR_LENGTH + 1;
+    directory[0].d.dir_struct.next_segment = 0;
+    directory[0].d.dir_struct.flag_word = 0;
+    directory[0].d.dir_struct.additional_words = negate(1);
+    directory[0].d.dir_struct.file_entries[1] = negate(device.filesystem_size);
+
+    if (!validate_directory(directory)) {
+        printf("Error validating directory after create?\n");
+        return false;
+    }
+
+    /* Size the file first.  The blocks past the directory are never written so the
+       image stays sparse on filesystems that support it.  Never shrink an existing
+       image, the other RK05 platter might live past the end of this one.
+    */
+    if (fstat(os8_file, &stat_buf) == -1) {
+        perror("stat");
+        return false;
+    }
+    if (stat_buf.st_size < device.image_size &&
+        ftruncate(os8_file, device.image_size) == -1) {
+        perror("Error extending device file in create filesystem");
+        return false;
+    }
+
+    /* Write the zero blocks in front of the directory and all of the directory blocks,
+       whether active or not, in one go.
+    */
+    os8_block_t blocks[FIRST_DIR_BLOCK + DIR_LENGTH] = {{0}};
+    for (unsigned i = 0; i < DIR_LENGTH; i++) {
+        memcpy(blocks[FIRST_DIR_BLOCK + i], directory[i].d.data, sizeof(os8_block_t));
+    }
+
+    if (!write_blocks(os8_file, 0, FIRST_DIR_BLOCK + DIR_LENGTH, blocks)) {
+        printf("Error writing initial directory in create filesystem\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* Tell the kernel how we're going to use a run of blocks.  It's only a hint, and a
+   no-op where posix_fadvise doesn't exist.
+*/
+bool advise_blocks(int os8_file, codec_t codec, unsigned block_no, unsigned count, int advice)
+{
+#ifdef POSIX_FADV_WILLNEED
+    off_t start, end;
+
+    codec.span(block_no, count, &start, &end);
+    int err = posix_fadvise(os8_file, start, end - start, advice);
+    if (err != 0) {
+        errno = err;
+        return false;
+    }
+#endif
+    return true;
+}
+
+/* Files, hashes and conversions that read more than this are dropped from the page
+   cache once they're done, since nothing is going to read them again soon.
+*/
+#define HUGE_EXTENT 1024
+
+void done_with_blocks(int os8_file, codec_t codec, unsigned block_no, unsigned count)
+{
+#ifdef POSIX_FADV_DONTNEED
+    if (count >= HUGE_EXTENT) {
+        advise_blocks(os8_file, codec, block_no, count, POSIX_FADV_DONTNEED);
+    }
+#endif
+}
+
+/* Whole image scans.  Freshly created images are mostly holes, so scans ask the
+   filesystem where the data is and hand back zero blocks for runs of blocks that
+   lie entirely in a hole without reading them.  The current data extent is cached
+   so a scan makes a couple of lseeks per extent rather than per read.
+*/
+typedef struct {
+    int os8_file;
+    codec_t codec;
+    off_t data_start;
+    off_t data_end;
+} scan_t;
+
+void init_scan(scan_t *scan, int os8_file, codec_t codec)
+{
+    scan->os8_file = os8_file;
+    scan->codec = codec;
+    scan->data_start = 0;
+    scan->data_end = 0;
+}
+
+/* True if the blocks lie entirely in a hole */
+bool scan_hole_p(scan_t *scan, unsigned block_no, unsigned count)
+{
+#ifdef SEEK_DATA
+    off_t start, end;
+
+    scan->codec.span(block_no, count, &start, &end);
+    if (start >= scan->data_end) {
+        off_t data_start = lseek(scan->os8_file, start, SEEK_DATA);
+        if (data_start == -1 && errno == ENXIO) {
+            /* nothing but hole from here to the end of the file */
+            scan->data_start = scan->data_end = LLONG_MAX;
+        } else if (data_start == -1) {
+            /* no hole support, it's all data */
+            scan->data_start = 0;
+            scan->data_end = LLONG_MAX;
+        } else {
+            off_t data_end = lseek(scan->os8_file, data_start, SEEK_HOLE);
+            scan->data_start = data_start;
+            scan->data_end = data_end == -1 ? LLONG_MAX : data_end;
+        }
+    }
+    return end <= scan->data_start;
+#else
+    return false;
+#endif
+}
+
+/* Sets *hole_p if the blocks were a hole and have been zeroed rather than read */
+bool scan_blocks(scan_t *scan, unsigned block_no, unsigned count, os8_block_t *blocks,
+                 bool *hole_p)
+{
+    if ((*hole_p = scan_hole_p(scan, block_no, count))) {
+        memset(blocks, 0, (size_t)count * sizeof(os8_block_t));
+        return true;
+    }
+    return scan->codec.read_blocks(scan->os8_file, block_no, count, blocks);
+}
+
+#define SCAN_CHUNK 64
+
+/* Bulk reads.  Whole image scans and file extraction read long runs of blocks in
+   order, and reading them one pread at a time leaves a fast device mostly idle.
+   With io_uring several runs are read at once and each is decoded as soon as it
+   arrives while the later ones are still on their way.  The reads complete in any
+   order, but the runs are handed to the caller in order.  If the kernel doesn't
+   have io_uring, or won't let us use it, each run is simply read with the codec's
+   reader when its turn comes.
+*/
+#define READ_QUEUE_DEPTH 8
+
+/* hole_p is set for runs that were zero filled rather than read */
+typedef bool (*run_callback_t)(unsigned block_no, unsigned count, os8_block_t *blocks,
+                               bool hole_p, void *ctx);
+
+typedef struct {
+    unsigned block_no;
+    unsigned count;
+    bool hole_p;
+    bool queued_p;
+    bool done_p;
+    int result;
+    off_t start;
+    size_t length;
+    size_t capacity;
+    unsigned char *bytes;
+    os8_block_t blocks[SCAN_CHUNK];
+} read_slot_t;
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int ring_fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned unsubmitted;
+    unsigned in_flight;
+} uring_t;
+
+/* The ring is set up the first time it's needed and kept for the life of the process.
+   There's just the one, so a thread that finds someone else using it does ordinary
+   reads instead.
+*/
+static uring_t uring;
+static enum {uring_untried, uring_ready, uring_unavailable} uring_state = uring_untried;
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool setup_uring(void)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    if ((uring.ring_fd = syscall(__NR_io_uring_setup, READ_QUEUE_DEPTH, &params)) == -1) {
+        return false;
+    }
+
+    uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.sq_ring_size = uring.cq_ring_size = MAX(uring.sq_ring_size, uring.cq_ring_size);
+    }
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, uring.ring_fd, IORING_OFF_SQ_RING);
+    uring.cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? uring.sq_ring :
+                    mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, uring.ring_fd, IORING_OFF_CQ_RING);
+    uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring.ring_fd, IORING_OFF_SQES);
+    if (uring.sq_ring == MAP_FAILED || uring.cq_ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        close(uring.ring_fd);
+        return false;
+    }
+
+    char *sq = uring.sq_ring;
+    char *cq = uring.cq_ring;
+    uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    uring.unsubmitted = 0;
+    uring.in_flight = 0;
+    return true;
+}
+
+bool uring_available_p(void)
+{
+    if (uring_state == uring_untried) {
+        uring_state = setup_uring() ? uring_ready : uring_unavailable;
+    }
+    return uring_state == uring_ready;
+}
+
+void uring_queue_read(int fd, read_slot_t *slot, unsigned tag)
+{
+    unsigned tail = *uring.sq_tail;
+    unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)slot->bytes;
+    sqe->len = slot->length;
+    sqe->off = slot->start;
+    sqe->user_data = tag;
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring.unsubmitted++;
+    uring.in_flight++;
+}
+
+/* Submit anything queued, wait for at least one read to finish and mark every
+   finished slot done.
+*/
+bool uring_reap(read_slot_t *slots)
+{
+    int submitted = syscall(__NR_io_uring_enter, uring.ring_fd, uring.unsubmitted, 1,
+                            IORING_ENTER_GETEVENTS, NULL, 0);
+    if (submitted == -1 && errno != EINTR) {
+        perror("io_uring_enter");
+        return false;
+    }
+    if (submitted > 0) {
+        uring.unsubmitted -= submitted;
+    }
+
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        slots[cqe->user_data].result = cqe->res;
+        slots[cqe->user_data].done_p = true;
+        uring.in_flight--;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    return true;
+}
+#endif
+
+/* Read blocks block_no through block_no + count - 1, calling callback with each
+   run of up to SCAN_CHUNK of them in order.  Stops at the first error or when the
+   callback returns false.
+*/
+bool read_runs(int os8_file, codec_t codec, unsigned block_no, unsigned count,
+               run_callback_t callback, void *ctx)
+{
+    read_slot_t *slots;
+    scan_t scan;
+    bool uring_p = false;
+    bool error_p = false;
+    unsigned next = block_no;
+    unsigned end = block_no + count;
+    unsigned head = 0, tail = 0;
+
+    if ((slots = calloc(READ_QUEUE_DEPTH, sizeof(read_slot_t))) == NULL) {
+        perror("calloc");
+        return false;
+    }
+#ifdef HAVE_IO_URING
+    /* not worth the trouble for a single run */
+    if (count > SCAN_CHUNK && pthread_mutex_trylock(&uring_lock) == 0) {
+        if (!(uring_p = uring_available_p())) {
+            pthread_mutex_unlock(&uring_lock);
+        }
+    }
+#endif
+    init_scan(&scan, os8_file, codec);
+
+    while (!error_p && (head < tail || next < end)) {
+
+        /* keep the queue full */
+        while (!error_p && tail - head < READ_QUEUE_DEPTH && next < end) {
+            read_slot_t *slot = &slots[tail % READ_QUEUE_DEPTH];
+            slot->block_no = next;
+            slot->count = MIN(SCAN_CHUNK, end - next);
+            slot->hole_p = scan_hole_p(&scan, slot->block_no, slot->count);
+            slot->queued_p = false;
+            slot->done_p = slot->hole_p || !uring_p;
+#ifdef HAVE_IO_URING
+            if (!slot->done_p) {
+                off_t stop;
+                codec.span(slot->block_no, slot->count, &slot->start, &stop);
+                slot->length = stop - slot->start;
+                if (slot->capacity < slot->length) {
+                    free(slot->bytes);
+                    if ((slot->bytes = malloc(slot->length)) == NULL) {
+                        perror("malloc");
+                        slot->capacity = 0;
+                        error_p = true;
+                        break;
+                    }
+                    slot->capacity = slot->length;
+                }
+                uring_queue_read(os8_file, slot, tail % READ_QUEUE_DEPTH);
+                slot->queued_p = true;
+            }
+#endif
+            next += slot->count;
+            tail++;
+        }
+        if (error_p) {
+            break;
+        }
+
+        read_slot_t *slot = &slots[head % READ_QUEUE_DEPTH];
+#ifdef HAVE_IO_URING
+        if (!slot->done_p) {
+            error_p = !uring_reap(slots);
+            continue;
+        }
+#endif
+
+        if (slot->hole_p) {
+            memset(slot->blocks, 0, slot->count * sizeof(os8_block_t));
+        } else if (slot->queued_p && slot->result == (int)slot->length) {
+            error_p = !codec.decode(slot->block_no, slot->count, slot->bytes, slot->blocks);
+        } else {
+            /* no io_uring, or a short or failed read, do it the old fashioned way */
+            error_p = !codec.read_blocks(os8_file, slot->block_no, slot->count, slot->blocks);
+        }
+        if (error_p) {
+            printf("Error reading block %u\n", slot->block_no);
+        } else {
+            error_p = !callback(slot->block_no, slot->count, slot->blocks, slot->hole_p, ctx);
+        }
+        head++;
+    }
+
+#ifdef HAVE_IO_URING
+    /* The kernel is still writing into the buffers of any reads in flight.  If we
+       can't wait for them the ring is given up on for good, and the buffers are
+       left to it rather than freed out from under it.
+    */
+    bool drained_p = true;
+    while (uring_p && uring.in_flight > 0) {
+        if (!uring_reap(slots)) {
+            uring_state = uring_unavailable;
+            drained_p = false;
+            break;
+        }
+    }
+    if (uring_p) {
+        pthread_mutex_unlock(&uring_lock);
+    }
+    if (!drained_p) {
+        return false;
+    }
+#endif
+    for (unsigned i = 0; i < READ_QUEUE_DEPTH; i++) {
+        free(slots[i].bytes);
+    }
+    free(slots);
+    return !error_p;
+}
+
+/* 64-bit FNV-1a over the words of a block, each as two bytes, low byte first */
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+uint64_t hash_words(uint64_t hash, pdp8_word_t *words, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ (words[i] & 0377)) * 0x100000001b3ULL;
+        hash = (hash ^ (words[i] >> 8)) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Hash the decoded contents of a whole device, so images of the same device in
+   different formats hash the same.
+*/
+bool hash_run(unsigned block_no, unsigned count, os8_block_t *blocks, bool hole_p,
+              void *ctx)
+{
+    uint64_t *hash = ctx;
+    *hash = hash_words(*hash, blocks[0], (size_t)count * OS8_BLOCK_SIZE);
+    return true;
+}
+
+bool hash_image(int os8_file, codec_t codec, unsigned blocks, uint64_t *hash)
+{
+    *hash = HASH_INIT;
+#ifdef POSIX_FADV_SEQUENTIAL
+    advise_blocks(os8_file, codec, 0, blocks, POSIX_FADV_SEQUENTIAL);
+#endif
+    bool ok = read_runs(os8_file, codec, 0, blocks, &hash_run, hash);
+    done_with_blocks(os8_file, codec, 0, blocks);
+    return ok;
+}
+
+/* Verification reads back what was written and compares it, word for word, with
+   what we meant to write.  The data has to go to the device and come back from
+   it, not from the page cache, so it's synced and dropped from the cache first.
+*/
+bool drop_cached_blocks(int os8_file, codec_t codec, unsigned block_no, unsigned count)
+{
+#ifdef POSIX_FADV_DONTNEED
+    if (!advise_blocks(os8_file, codec, block_no, count, POSIX_FADV_DONTNEED)) {
+        perror("posix_fadvise");
+        return false;
+    }
+#endif
+    return true;
+}
+
+/* Returns the number of blocks that don't match */
+unsigned compare_blocks(unsigned block_no, unsigned count, os8_block_t *expected,
+                        os8_block_t *actual, const_str_t image_name)
+{
+    unsigned mismatches = 0;
+
+    for (unsigned i = 0; i < count; i++) {
+        if (memcmp(expected[i], actual[i], sizeof(os8_block_t)) != 0) {
+            printf("Block %u of %s doesn't match what was written\n", block_no + i, image_name);
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+/* Imports remember each block they write here, and it's all checked at the end.  An
+   OS/8 filesystem is at most 4096 blocks, so keeping a copy is cheap enough.
+*/
+typedef struct {
+    os8_block_t *blocks;
+    bool *written_p;
+} verify_t;
+
+bool init_verify(verify_t *verify)
+{
+    verify->blocks = malloc(DSK_MAX_BLOCKS * sizeof(os8_block_t));
+    verify->written_p = calloc(DSK_MAX_BLOCKS, sizeof(bool));
+    if (verify->blocks == NULL || verify->written_p == NULL) {
+        perror("malloc");
+        return false;
+    }
+    return true;
+}
+
+/* verify is NULL if we're not verifying */
+void record_block(verify_t *verify, unsigned block_no, os8_block_t block)
+{
+    if (verify != NULL && block_no < DSK_MAX_BLOCKS) {
+        memcpy(verify->blocks[block_no], block, sizeof(os8_block_t));
+        verify->written_p[block_no] = true;
+    }
+}
+
+/* Read back each run of written blocks in large reads */
+bool verify_blocks(verify_t *verify, int os8_file, codec_t codec, const_str_t image_name)
+{
+    os8_block_t *buffer;
+    unsigned mismatches = 0;
+
+    if (fdatasync(os8_file) == -1) {
+        perror("fdatasync");
+        return false;
+    }
+
+    if ((buffer = malloc(SCAN_CHUNK * sizeof(os8_block_t))) == NULL) {
+        perror("malloc");
+        return false;
+    }
+
+    for (unsigned block_no = 0; block_no < DSK_MAX_BLOCKS;) {
+        unsigned count = 0;
+        while (block_no + count < DSK_MAX_BLOCKS && count < SCAN_CHUNK &&
+               verify->written_p[block_no + count]) {
+            count++;
+        }
+        if (count == 0) {
+            block_no++;
+            continue;
+        }
+        if (!drop_cached_blocks(os8_file, codec, block_no, count) ||
+            !codec.read_blocks(os8_file, block_no, count, buffer)) {
+            printf("Error reading back block %u\n", block_no);
+            free(buffer);
+            return false;
+        }
+        mismatches += compare_blocks(block_no, count, &verify->blocks[block_no], buffer,
+                                     image_name);
+        block_no += count;
+    }
+
+    free(buffer);
+    return mismatches == 0;
+}
+
+/* The directory is written last, so it's recorded just before being written */
+void record_directory(verify_t *verify, directory_t directory)
+{
+    int block_no = FIRST_DIR_BLOCK;
+
+    do {
+        int i = block_no - FIRST_DIR_BLOCK;
+        if (directory[i].dirty) {
+            record_block(verify, block_no, directory[i].d.data);
+        }
+        block_no = directory[i].d.dir_struct.next_segment;
+    } while (block_no > 0 && block_no <= DIR_LENGTH);
+}
+
+/* Copy a whole device image to a new image file, possibly of another format.  The
+   format of the new file comes from its extension.  Packed-12 images record the
+   format of the device they hold and can be any size, the others must have the
+   same number of blocks as the source.  A new .rk05 file uses the Mac PDP-8/e
+   layout unless it is restoring a packed-12 image of a simh pack, .dsk gives the
+   simh layout.
+*/
+
+typedef struct {
+    int output_file;
+    codec_t output_codec;
+    const_str_t output_name;
+} convert_ctx_t;
+
+/* the new image starts out as one big hole, so holes needn't be copied */
+bool convert_run(unsigned block_no, unsigned count, os8_block_t *blocks, bool hole_p,
+                 void *ctx)
+{
+    convert_ctx_t *convert = ctx;
+
+    if (!hole_p && !convert->output_codec.write_blocks(convert->output_file, block_no, count,
+                                                       blocks)) {
+        printf("Error writing block %u of %s\n", block_no, convert->output_name);
+        return false;
+    }
+    return true;
+}
+
+/* Creates a new, empty (and sparse) image of a blocks long device for the whole
+   device to be written to.
+*/
+bool create_image_file(const_str_t output_name, format_t output_format,
+                       format_t device_format, unsigned blocks, int *output_file,
+                       codec_t *output_codec)
+{
+    device_t output_device;
+
+    if (output_format == packed12) {
+        packed12_header_t header = {device_format, blocks};
+        if (!get_packed12_device(&output_device, header)) {
+            return false;
+        }
+    } else {
+        if (output_format != dsk && device_blocks(output_format, 0) != blocks) {
+            printf("A %u block device won't convert to %s\n", blocks, output_name);
+            return false;
+        }
+        if (!get_device(&output_device, output_format, MIN(blocks, DSK_MAX_BLOCKS))) {
+            return false;
+        }
+        if (output_format == dsk) {
+            output_device.image_size = (off_t)blocks * OS8_BLOCK_SIZE * 2;
+        }
+    }
+
+    if (!get_codec(output_format, base, output_codec)) {
+        return false;
+    }
+
+    if ((*output_file = open(output_name, O_RDWR | O_CREAT | O_EXCL,
+         S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)) == -1) {
+        perror("Error opening output image");
+        return false;
+    }
+
+    bool error_p = ftruncate(*output_file, output_device.image_size) == -1;
+    if (!error_p && output_format == packed12) {
+        packed12_header_t header = {device_format, blocks};
+        error_p = !write_packed12_header(*output_file, header);
+    }
+    if (error_p) {
+        printf("Error creating %s: %s\n", output_name, strerror(errno));
+        close(*output_file);
+        unlink(output_name);
+        return false;
+    }
+    return true;
+}
+
+/* device_format is the format of the device held by a packed-12 image, otherwise
+   the same as format.
+*/
+bool convert_image(int os8_file, codec_t codec, format_t format, format_t device_format,
+                   unsigned blocks, const_str_t output_name, bool verify_p)
+{
+    format_t output_format = format_from_extension(output_name);
+    codec_t output_codec;
+    int output_file;
+
+    if (output_format == unknown) {
+        printf("Can't tell the format of %s from its extension\n", output_name);
+        return false;
+    }
+    if (output_format == rk05 && format == packed12 && device_format == simh_rk05) {
+        output_format = simh_rk05;
+    }
+    if (!create_image_file(output_name, output_format, device_format, blocks, &output_file,
+                           &output_codec)) {
+        return false;
+    }
+
+    convert_ctx_t convert_ctx = {output_file, output_codec, output_name};
+#ifdef POSIX_FADV_SEQUENTIAL
+    advise_blocks(os8_file, codec, 0, blocks, POSIX_FADV_SEQUENTIAL);
+#endif
+    bool error_p = !read_runs(os8_file, codec, 0, blocks, &convert_run, &convert_ctx);
+
+    /* read both images again, the new one from the device */
+    if (!error_p && verify_p) {
+        os8_block_t *buffer, *output_buffer;
+        unsigned mismatches = 0;
+        scan_t scan;
+
+        if (fdatasync(output_file) == -1) {
+            perror("fdatasync");
+            error_p = true;
+        } else if ((buffer = malloc(SCAN_CHUNK * sizeof(os8_block_t))) == NULL ||
+                   (output_buffer = malloc(SCAN_CHUNK * sizeof(os8_block_t))) == NULL) {
+            perror("malloc");
+            free(buffer);
+            error_p = true;
+        } else {
+            init_scan(&scan, os8_file, codec);
+            for (unsigned block_no = 0; !error_p && block_no < blocks; block_no += SCAN_CHUNK) {
+                unsigned count = MIN(SCAN_CHUNK, blocks - block_no);
+                bool hole_p;
+                if (!scan_blocks(&scan, block_no, count, buffer, &hole_p) ||
+                    !drop_cached_blocks(output_file, output_codec, block_no, count) ||
+                    !output_codec.read_blocks(output_file, block_no, count, output_buffer)) {
+                    printf("Error reading back block %u\n", block_no);
+                    error_p = true;
+                } else {
+                    mismatches += compare_blocks(block_no, count, buffer, output_buffer,
+                                                 output_name);
+                }
+            }
+            free(buffer);
+            free(output_buffer);
+            error_p |= mismatches != 0;
+        }
+    }
+    done_with_blocks(os8_file, codec, 0, blocks);
+
+    close(output_file);
+    if (error_p) {
+        unlink(output_name);
+    }
+    return !error_p;
+}
+
+void print_directory(directory_t directory, long columns, const_str_t match_filename,
+                     bool print_empties_p)
+{
+    cursor_t cursor;
+    entry_t entry;
+    long column = 0;
+    pdp8_word_t files = 0;
+    pdp8_word_t used = 0;
+    pdp8_word_t empty = 0;
+    pattern_t pattern;
+
+    build_pattern(match_filename, &pattern);
+
+    init_cursor(directory, &cursor);
+    while (valid_entry(&cursor)) {
+        get_entry(&cursor, &entry);
+        if (entry.empty_file) {
+            empty += entry.length;
+        }
+        if (entry.empty_file && print_empties_p) {
+            printf("%-11s", "<empty>");
+        } else if (!entry.empty_file && entry.length != 0 && 
+                   pattern_match_p(entry.name, pattern)) {
+            os8_filename_t filename;
+            get_filename(entry.name, filename);
+            printf("%-11s", filename);
+            used += entry.length;
+            files++;
+        } else {
+            continue;
+        }
+        column++;
+        printf("%5d", entry.length);
+        if (column % columns != 0) {
+            printf("%10s", " ");
+        } else {
+            putchar('\n');
+        }
+    }
+    if (column % columns != 0) {
+        putchar('\n');
+    }
+    printf("\n  %d Files In %d Blocks - %d Free Blocks\n", files, used, empty);
+}
+
+void delete_entry(entry_t *entry)
+{
+    /* scrunch the directory segment down to the end of the new
+       entry, accounting for the fact that we didn't remove the
+       file but will be changing it to an empty file.  The
+       order here is important.
+    */
+    fix_segment_down(*entry, EMPTY_ENTRY_LENGTH);
+    entry->empty_file = true; 
+    put_entry(*entry);        
+}
+
+/*
+  Makes a new OS/8 file.  It will delete the old one and return an
+  entry for an empty file that's at least as large as the size requested.
+
+  It allows one to request the largest available block by passing zero as
+  the size, just like OS/8, but this program doesn't use this.
+
+  Don't write more blocks than are contained in the empty file entry that
+  is returned!
+
+*/
+
+/* A size of zero asks for the largest empty.  If at_most_p is set size is only an
+   upper bound and we'll settle for the largest empty if nothing is that big.
+*/
+bool allocate_os8_file(char *filename, unsigned size, bool at_most_p, directory_t directory,
+                       entry_t *entry)
+{
+    entry_t exclude_entry = {0};
+    cursor_t cursor;
+
+    init_cursor(directory, &cursor);
+    if (lookup(filename, directory, &cursor, &exclude_entry)) {
+        delete_entry(&exclude_entry);
+    }
+
+    return get_empty_entry(directory, exclude_entry, entry, size) ||
+           (at_most_p && get_empty_entry(directory, exclude_entry, entry, 0));
+}
+
+/* You must call this with the entry passed back by get_empty_file */
+
+bool enter_os8_file(char *filename, unsigned size, directory_t directory, entry_t entry)
+{
+    if (enter(filename, size, directory, entry)) {
+        consolidate(directory);
+        return true;
+    }
+    return false;
+}
+
+
+/* An OS/8 file being written.  Words are collected in a block buffer which is
+   written out as it fills, and the directory entry is made when the file is closed,
+   with however many blocks were written.  That lets us write files whose length
+   we don't know up front into the largest empty and trim it afterwards.
+*/
+typedef struct {
+    int os8_file;
+    block_io_t write_block;
+    verify_t *verify;
+    dir_block_t *directory;
+    char *filename;
+    entry_t entry;
+    unsigned block_no;
+    unsigned word_cnt;
+    os8_block_t block;
+} os8_output_t;
+
+bool open_os8_output(os8_output_t *output, int os8_file, block_io_t write_block,
+                     verify_t *verify, directory_t directory, char *filename,
+                     unsigned size, bool at_most_p)
+{
+    output->os8_file = os8_file;
+    output->write_block = write_block;
+    output->verify = verify;
+    output->directory = directory;
+    output->filename = filename;
+    output->block_no = 0;
+    output->word_cnt = 0;
+    return allocate_os8_file(filename, size, at_most_p, directory, &output->entry);
+}
+
+bool flush_os8_output(os8_output_t *output)
+{
+    if (output->block_no >= output->entry.length) {
+        printf("No room for %s\n", output->filename);
+        return false;
+    }
+
+    /* zero out the rest of the block to avoid "data corrupted" message */
+    for (pdp8_word_t *p = output->block + output->word_cnt; p < output->block + OS8_BLOCK_SIZE;) {
+       *p++ = 0;
+    }
+
+    unsigned block_no = output->entry.file_block + output->block_no;
+    if (!output->write_block(output->os8_file, block_no, output->block)) {
+        return false;
+    }
+    record_block(output->verify, block_no, output->block);
+    output->block_no++;
+    output->word_cnt = 0;
+    return true;
+}
+
+bool put_os8_word(os8_output_t *output, pdp8_word_t word)
+{
+    output->block[output->word_cnt++] = word;
+    return output->word_cnt < OS8_BLOCK_SIZE || flush_os8_output(output);
+}
+
+bool close_os8_output(os8_output_t *output)
+{
+    if (output->word_cnt > 0 && !flush_os8_output(output)) {
+        return false;
+    }
+    return enter_os8_file(output->filename, output->block_no, output->directory, output->entry);
+}
+
+/* size is zero if we don't know it, as when reading stdin */
+bool stream_host_image_file(FILE *input, int os8_file, block_io_t write_block,
+                            verify_t *verify, directory_t directory, char *outputname,
+                            unsigned size)
+{
+    os8_output_t output;
+
+    /* Compute size for get_empty_entry */
+    unsigned output_size = (size + (OS8_BLOCK_SIZE - 1) * 2)  /
+                           (OS8_BLOCK_SIZE * 2);
+    if (!open_os8_output(&output, os8_file, write_block, verify, directory, outputname,
+                         output_size, false)) {
+        return false;
+    }
+
+    int cnt;
+    while ((cnt = fread(output.block + output.word_cnt, 2, OS8_BLOCK_SIZE - output.word_cnt,
+                        input)) > 0) {
+        output.word_cnt += cnt;
+        if (output.word_cnt == OS8_BLOCK_SIZE && !flush_os8_output(&output)) {
+            return false;
+        }
+    }
+
+    return close_os8_output(&output);
+}
+
+/* The encoder packs host characters three to two words, into a buffer supplied by
+   the caller.  All of its state is here so any number of them can be going at once.
+   Text files get the mark bit set and <cr>s added in front of newlines as needed,
+   binary files go in as they are, and both end at the first ^Z.
+
+   feed_encoder takes as much of the buffer as it can, stopping when the caller's
+   word buffer is full, and returns how many bytes it used.  The caller empties
+   the word buffer, calls encoder_emptied and carries on.  finish_encoder needs
+   room for two more words.
+*/
+typedef struct {
+    filename_type_t type;
+    bool first_lf;
+    bool ctrl_z_seen;
+    unsigned char_cnt;
+    pdp8_word_t w[2];
+    pdp8_word_t *words;
+    unsigned word_max;
+    unsigned word_cnt;
+} encoder_t;
+
+void init_encoder(encoder_t *encoder, filename_type_t type, pdp8_word_t *words,
+                  unsigned word_max)
+{
+    encoder->type = type;
+    encoder->first_lf = true;
+    encoder->ctrl_z_seen = false;
+    encoder->char_cnt = 0;
+    encoder->words = words;
+    encoder->word_max = word_max;
+    encoder->word_cnt = 0;
+}
+
+bool encoder_full_p(encoder_t *encoder)
+{
+    return encoder->word_max - encoder->word_cnt < 2;
+}
+
+void encoder_emptied(encoder_t *encoder)
+{
+    encoder->word_cnt = 0;
+}
+
+void put_encoder_char(encoder_t *encoder, pdp8_word_t ch)
+{
+    switch (encoder->char_cnt % 3) {
+    case 0:
+        encoder->w[0] = ch;
+        break;
+    case 1:
+        encoder->w[1] = ch;
+        break;
+    case 2:
+        encoder->w[0] |= (ch & 0360) << 4;
+        encoder->w[1] |= (ch & 017) << 8;
+        encoder->words[encoder->word_cnt++] = encoder->w[0];
+        encoder->words[encoder->word_cnt++] = encoder->w[1];
+        break;
+    }
+    encoder->char_cnt++;
+}
+
+size_t feed_encoder(encoder_t *encoder, const unsigned char *buffer, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        int c = buffer[i];
+
+        /* anything after the ^Z is ignored */
+        if (encoder->ctrl_z_seen) {
+            return length;
+        }
+
+        /* each character makes at most two, finishing at most two words */
+        if (encoder_full_p(encoder)) {
+            break;
+        }
+
+        if (encoder->type == text_type) {
+            encoder->ctrl_z_seen = c == '\032';
+            if (c == '\012'  && encoder->first_lf) {
+                put_encoder_char(encoder, 0215);
+            }
+            encoder->first_lf = (c != '\012') && (c != '\015');
+            if (c != '\0') {
+                put_encoder_char(encoder, c | 0200); /* always set the mark bit */
+            }
+        } else {
+            encoder->ctrl_z_seen = c == 0232;
+            put_encoder_char(encoder, c);
+        }
+    }
+    return i;
+}
+
+void finish_encoder(encoder_t *encoder)
+{
+    /* OS/8 will be very unhappy without its ^Z at the end */
+    if (!encoder->ctrl_z_seen) {
+        put_encoder_char(encoder, 0232);
+    }
+
+    /* flush partial output */
+    put_encoder_char(encoder, 0);
+    put_encoder_char(encoder, 0);
+}
+
+#define HOST_BUFFER_SIZE (64 * 1024)
+
+/* The blocks a regular host file packs into, found by running it through an encoder
+   whose words are thrown away.  Text files grow by a <cr> for each newline without
+   one, so the size alone doesn't say.  The file is rewound for the real thing.
+*/
+bool count_host_char_blocks(FILE *input, filename_type_t type, unsigned *blocks)
+{
+    encoder_t encoder;
+    pdp8_word_t words[OS8_BLOCK_SIZE];
+    unsigned char *buffer;
+    size_t length;
+    off_t start = ftello(input);
+
+    *blocks = 0;
+    if (start == -1) {
+        perror("ftello");
+        return false;
+    }
+    if ((buffer = malloc(HOST_BUFFER_SIZE)) == NULL) {
+        perror("malloc");
+        return false;
+    }
+    init_encoder(&encoder, type, words, OS8_BLOCK_SIZE);
+
+    while (!encoder.ctrl_z_seen && (length = fread(buffer, 1, HOST_BUFFER_SIZE, input)) > 0) {
+        for (size_t done = 0; done < length;) {
+            done += feed_encoder(&encoder, buffer + done, length - done);
+            if (encoder_full_p(&encoder)) {
+                (*blocks)++;
+                encoder_emptied(&encoder);
+            }
+        }
+    }
+    free(buffer);
+
+    if (encoder_full_p(&encoder)) {
+        (*blocks)++;
+        encoder_emptied(&encoder);
+    }
+    finish_encoder(&encoder);
+    if (encoder.word_cnt > 0) {
+        (*blocks)++;
+    }
+    return !ferror(input) && fseeko(input, start, SEEK_SET) == 0;
+}
+
+/* Text and binary files are packed straight into the OS/8 file.  A regular file is
+   counted first and goes into the best fitting empty like any other.  The size of
+   anything else (a pipe, say) isn't known, so it goes into the biggest empty there
+   is and the file is trimmed to what was actually written when it's entered.
+*/
+bool stream_host_char_file(FILE *input, filename_type_t type, int os8_file,
+                           block_io_t write_block, verify_t *verify, directory_t directory,
+                           char *outputname, off_t size)
+{
+    os8_output_t output;
+    encoder_t encoder;
+    unsigned char *buffer;
+    size_t length;
+    unsigned blocks = 0;
+    bool ok = true;
+
+    if (size != 0 && !count_host_char_blocks(input, type, &blocks)) {
+        printf("Error reading the file to be copied to %s\n", outputname);
+        return false;
+    }
+    if (!open_os8_output(&output, os8_file, write_block, verify, directory, outputname,
+                         blocks, blocks == 0)) {
+        return false;
+    }
+    if ((buffer = malloc(HOST_BUFFER_SIZE)) == NULL) {
+        perror("malloc");
+        return false;
+    }
+    init_encoder(&encoder, type, output.block, OS8_BLOCK_SIZE);
+
+    while (ok && !encoder.ctrl_z_seen &&
+           (length = fread(buffer, 1, HOST_BUFFER_SIZE, input)) > 0) {
+        for (size_t done = 0; ok && done < length;) {
+            done += feed_encoder(&encoder, buffer + done, length - done);
+            output.word_cnt = encoder.word_cnt;
+            if (encoder_full_p(&encoder)) {
+                ok = flush_os8_output(&output);
+                encoder_emptied(&encoder);
+            }
+        }
+    }
+    free(buffer);
+
+    if (ok && encoder_full_p(&encoder)) {
+        ok = flush_os8_output(&output);
+        encoder_emptied(&encoder);
+    }
+    if (!ok) {
+        return false;
+    }
+    finish_encoder(&encoder);
+    output.word_cnt = encoder.word_cnt;
+
+    return close_os8_output(&output);
+}
+
+bool write_image_run(unsigned block_no, unsigned count, os8_block_t *blocks, bool hole_p,
+                     void *ctx)
+{
+    FILE *output = ctx;
+    return fwrite(blocks, sizeof(os8_block_t), count, output) == count;
+}
+
+/* Exporting a big file is a two stage pipeline.  A reader thread reads and decodes
+   runs of blocks into a small ring of buffers while this thread turns them into host
+   bytes and writes them out, so the image is being read while the output is being
+   written rather than in turns.  The reader keeps up to PIPELINE_DEPTH runs ahead,
+   which takes the place of the io_uring queue read_runs would use.  Small files
+   aren't worth a thread.
+*/
+#define PIPELINE_DEPTH 4
+#define PIPELINE_MIN_BLOCKS 128
+
+typedef struct {
+    unsigned block_no;
+    unsigned count;
+    bool hole_p;
+    os8_block_t blocks[SCAN_CHUNK];
+} pipeline_slot_t;
+
+typedef struct {
+    int os8_file;
+    codec_t codec;
+    unsigned block_no;
+    unsigned count;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+    unsigned head; /* next slot for the writer */
+    unsigned tail; /* next slot for the reader */
+    bool done_p;
+    bool read_ok_p;
+    bool cancel_p;
+    pipeline_slot_t slots[PIPELINE_DEPTH];
+} pipeline_t;
+
+/* The reader fills the slots in place, so the only copy of a run is the one the
+   codec decodes it into.
+*/
+void *pipeline_reader(void *arg)
+{
+    pipeline_t *pipeline = arg;
+    scan_t scan;
+    bool ok = true;
+
+    init_scan(&scan, pipeline->os8_file, pipeline->codec);
+    for (unsigned done = 0; done < pipeline->count;) {
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->tail - pipeline->head == PIPELINE_DEPTH && !pipeline->cancel_p) {
+            pthread_cond_wait(&pipeline->emptied, &pipeline->lock);
+        }
+        bool cancel_p = pipeline->cancel_p;
+        pthread_mutex_unlock(&pipeline->lock);
+        if (cancel_p) {
+            break;
+        }
+
+        /* the slot is ours until tail moves past it */
+        pipeline_slot_t *slot = &pipeline->slots[pipeline->tail % PIPELINE_DEPTH];
+        slot->block_no = pipeline->block_no + done;
+        slot->count = MIN(SCAN_CHUNK, pipeline->count - done);
+        if (!scan_blocks(&scan, slot->block_no, slot->count, slot->blocks, &slot->hole_p)) {
+            fprintf(stderr, "Error reading block %u\n", slot->block_no);
+            ok = false;
+            break;
+        }
+        done += slot->count;
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->tail++;
+        pthread_cond_signal(&pipeline->filled);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->read_ok_p = ok;
+    pipeline->done_p = true;
+    pthread_cond_signal(&pipeline->filled);
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+/* Works just like read_runs, with the callback running in this thread */
+bool pipeline_runs(int os8_file, codec_t codec, unsigned block_no, unsigned count,
+                   run_callback_t callback, void *ctx)
+{
+    pipeline_t *pipeline;
+    pthread_t reader;
+
+    if (count < PIPELINE_MIN_BLOCKS ||
+        (pipeline = calloc(1, sizeof(pipeline_t))) == NULL) {
+        return read_runs(os8_file, codec, block_no, count, callback, ctx);
+    }
+
+    pipeline->os8_file = os8_file;
+    pipeline->codec = codec;
+    pipeline->block_no = block_no;
+    pipeline->count = count;
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->filled, NULL);
+    pthread_cond_init(&pipeline->emptied, NULL);
+
+    if (pthread_create(&reader, NULL, &pipeline_reader, pipeline) != 0) {
+        free(pipeline);
+        return read_runs(os8_file, codec, block_no, count, callback, ctx);
+    }
+
+    bool write_ok_p = true;
+    while (write_ok_p) {
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->head == pipeline->tail && !pipeline->done_p) {
+            pthread_cond_wait(&pipeline->filled, &pipeline->lock);
+        }
+        bool empty_p = pipeline->head == pipeline->tail;
+        pthread_mutex_unlock(&pipeline->lock);
+        if (empty_p) {
+            break;
+        }
+
+        pipeline_slot_t *slot = &pipeline->slots[pipeline->head % PIPELINE_DEPTH];
+        write_ok_p = callback(slot->block_no, slot->count, slot->blocks, slot->hole_p, ctx);
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->head++;
+        pipeline->cancel_p = !write_ok_p;
+        pthread_cond_signal(&pipeline->emptied);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+
+    pthread_join(reader, NULL);
+    bool ok = write_ok_p && pipeline->read_ok_p;
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->filled);
+    pthread_cond_destroy(&pipeline->emptied);
+    free(pipeline);
+    return ok;
+}
+
+void done_with_extent(entry_t entry, int os8_file, codec_t codec)
+{
+    done_with_blocks(os8_file, codec, entry.file_block, entry.length);
+}
+
+bool stream_os8_image_file(entry_t entry, int os8_file, codec_t codec, FILE *output)
+{
+    bool ok = pipeline_runs(os8_file, codec, entry.file_block, entry.length,
+                            &write_image_run, output);
+    done_with_extent(entry, os8_file, codec);
+    return ok;
+}
+
+/* Three characters are packed in two words, so every block holds exactly 384 of
+   them and a run of blocks can be unpacked without knowing what came before it.
+*/
+#define CHARS_PER_BLOCK (OS8_BLOCK_SIZE * 3 / 2)
+
+/* Text loses its mark bits, nulls, rubouts and <cr>s and ends at the ^Z, which sets
+   *eof_p.  Filters in place, returning the number of characters kept.
+*/
+size_t filter_text_chars(char *chars, size_t length, bool *eof_p)
+{
+    char *char_ptr = chars;
+
+    *eof_p = false;
+    for (size_t i = 0; i < length; i++) {
+        char ch = chars[i] & 0177;
+        if (ch == 032) {
+            *eof_p = true;
+            break;
+        }
+        if (ch != 0177 && ch != 015 && ch != 0) {
+            *char_ptr++ = ch;
+        }
+    }
+    return char_ptr - chars;
+}
+
+/* Unpack count blocks into chars, returning the number of characters kept */
+size_t unpack_chars(pdp8_word_t *words, unsigned count, filename_type_t type, char *chars,
+                    bool *eof_p)
+{
+    char *char_ptr = chars;
+
+    for (pdp8_word_t *word_ptr = words; word_ptr < words + count * OS8_BLOCK_SIZE; word_ptr += 2) {
+        *char_ptr++ = *word_ptr & 0377;
+        *char_ptr++ = *(word_ptr + 1) & 0377;
+        *char_ptr++ = ((*word_ptr >> 4) & 0360) | *(word_ptr + 1) >> 8;
+    }
+
+    *eof_p = false;
+    if (type == text_type) {
+        return filter_text_chars(chars, char_ptr - chars, eof_p);
+    }
+    return char_ptr - chars;
+}
+
+typedef struct {
+    filename_type_t type;
+    FILE *output;
+    bool eof_p;
+    bool error_p;
+} byte_stream_t;
+
+bool write_byte_run(unsigned block_no, unsigned count, os8_block_t *blocks, bool hole_p,
+                    void *ctx)
+{
+    byte_stream_t *stream = ctx;
+    char chars[SCAN_CHUNK * CHARS_PER_BLOCK];
+
+    size_t length = unpack_chars(blocks[0], count, stream->type, chars, &stream->eof_p);
+    if (fwrite(chars, 1, length, stream->output) != length) {
+        stream->error_p = true;
+        return false;
+    }
+    /* anything after the ^Z is garbage, so that's where the reading stops */
+    return !stream->eof_p;
+}
+
+/* Runs a worker on a thread per processor, up to MAX_WORKER_THREADS and no more than
+   there are jobs.  The workers take jobs from ctx until there are none left.  If no
+   thread can be started the work is done here.
+*/
+#define MAX_WORKER_THREADS 8
+
+void run_workers(void *(*worker)(void *), void *ctx, unsigned jobs)
+{
+    pthread_t workers[MAX_WORKER_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = MIN(MAX(cpus, 1), MIN(MAX_WORKER_THREADS, MAX(jobs, 1)));
+    unsigned started = 0;
+
+    while (started < threads && pthread_create(&workers[started], NULL, worker, ctx) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        worker(ctx);
+    }
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+/* Big files are unpacked by several threads at once.  Each takes the next range of
+   blocks, reads it and unpacks it into its own part of one big character buffer,
+   so some ranges are being read while others are being unpacked.  Once a range
+   turns up the ^Z the ranges after it aren't read, and the ranges are written in
+   order up to that one.
+*/
+#define PARALLEL_UNPACK_MIN_BLOCKS 512
+#define UNPACK_RANGE_BLOCKS 128
+
+typedef struct {
+    size_t length;
+    bool eof_p;
+    bool ok;
+} unpack_range_t;
+
+typedef struct {
+    entry_t entry;
+    filename_type_t type;
+    int os8_file;
+    codec_t codec;
+    char *chars;
+    unpack_range_t *ranges;
+    unsigned count;
+    unsigned next;
+    unsigned eof_range;
+    pthread_mutex_t lock;
+} unpack_t;
+
+void *unpack_worker(void *ctx)
+{
+    unpack_t *unpack = ctx;
+    os8_block_t blocks[UNPACK_RANGE_BLOCKS];
+
+    while (true) {
+        pthread_mutex_lock(&unpack->lock);
+        unsigned i = unpack->next++;
+        bool past_eof_p = i > unpack->eof_range;
+        pthread_mutex_unlock(&unpack->lock);
+        if (i >= unpack->count) {
+            return NULL;
+        }
+        if (past_eof_p) {
+            continue;
+        }
+
+        unpack_range_t *range = &unpack->ranges[i];
+        unsigned first = i * UNPACK_RANGE_BLOCKS;
+        unsigned count = MIN(UNPACK_RANGE_BLOCKS, unpack->entry.length - first);
+        unsigned block_no = unpack->entry.file_block + first;
+        if (!(range->ok = unpack->codec.read_blocks(unpack->os8_file, block_no, count, blocks))) {
+            fprintf(stderr, "Error reading block %u\n", block_no);
+            continue;
+        }
+        range->length = unpack_chars(blocks[0], count, unpack->type,
+                                     unpack->chars + (size_t)first * CHARS_PER_BLOCK,
+                                     &range->eof_p);
+        if (range->eof_p) {
+            pthread_mutex_lock(&unpack->lock);
+            unpack->eof_range = MIN(unpack->eof_range, i);
+            pthread_mutex_unlock(&unpack->lock);
+        }
+    }
+}
+
+bool parallel_stream_os8_byte_file(entry_t entry, filename_type_t type, int os8_file,
+                                   codec_t codec, FILE *output)
+{
+    unsigned count = (entry.length + UNPACK_RANGE_BLOCKS - 1) / UNPACK_RANGE_BLOCKS;
+    unpack_t unpack = {entry, type, os8_file, codec,
+                       malloc((size_t)entry.length * CHARS_PER_BLOCK),
+                       calloc(count, sizeof(unpack_range_t)), count, 0, UINT_MAX,
+                       PTHREAD_MUTEX_INITIALIZER};
+
+    if (unpack.chars == NULL || unpack.ranges == NULL) {
+        perror("malloc");
+        free(unpack.chars);
+        free(unpack.ranges);
+        return false;
+    }
+    run_workers(&unpack_worker, &unpack, count);
+
+    /* the ranges after the one with the ^Z were never read */
+    bool ok = true;
+    unsigned last = MIN(unpack.eof_range, count - 1);
+    for (unsigned i = 0; ok && i <= last; i++) {
+        unpack_range_t *range = &unpack.ranges[i];
+        char *chars = unpack.chars + (size_t)i * UNPACK_RANGE_BLOCKS * CHARS_PER_BLOCK;
+        ok = range->ok && fwrite(chars, 1, range->length, output) == range->length;
+    }
+
+    free(unpack.chars);
+    free(unpack.ranges);
+    return ok;
+}
+
+bool stream_os8_byte_file(entry_t entry, filename_type_t type, int os8_file,
+                          codec_t codec, FILE *output)
+{
+    bool ok;
+
+    if (entry.length >= PARALLEL_UNPACK_MIN_BLOCKS && sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+        ok = parallel_stream_os8_byte_file(entry, type, os8_file, codec, output);
+    } else {
+        byte_stream_t stream = {type, output, false, false};
+        ok = pipeline_runs(os8_file, codec, entry.file_block, entry.length,
+                           &write_byte_run, &stream) || (stream.eof_p && !stream.error_p);
+    }
+    done_with_extent(entry, os8_file, codec);
+    return ok;
+}
+
+int compare_extents(const void *a, const void *b)
+{
+    const entry_t *entry_a = a;
+    const entry_t *entry_b = b;
+    return (int)entry_a->file_block - (int)entry_b->file_block;
+}
+
+/* The directory tells us exactly what we're about to read, so let the kernel start
+   reading all of it, in file order with adjacent files merged, before the first
+   file is copied.
+*/
+void prefetch_os8_files(char **argv, int first, int last, int os8_file, codec_t codec,
+                        directory_t directory)
+{
+#ifdef POSIX_FADV_WILLNEED
+    entry_t *extents = NULL;
+    size_t extent_count = 0;
+    size_t extent_max = 0;
+
+    for (int i = first; i < last; i++) {
+        cursor_t cursor;
+        entry_t entry;
+
+        init_cursor(directory, &cursor);
+        while (lookup(argv[i], directory, &cursor, &entry)) {
+            if (extent_count == extent_max) {
+                extent_max = extent_max == 0 ? 64 : extent_max * 2;
+                entry_t *temp = realloc(extents, extent_max * sizeof(entry_t));
+                if (temp == NULL) {
+                    free(extents);
+                    return;
+                }
+                extents = temp;
+            }
+            extents[extent_count++] = entry;
+        }
+    }
+
+    if (extent_count > 0) {
+        qsort(extents, extent_count, sizeof(entry_t), &compare_extents);
+    }
+
+    for (size_t i = 0; i < extent_count;) {
+        unsigned block_no = extents[i].file_block;
+        unsigned end = block_no + extents[i].length;
+        for (i++; i < extent_count && extents[i].file_block <= end; i++) {
+            end = MAX(end, extents[i].file_block + extents[i].length);
+        }
+        advise_blocks(os8_file, codec, block_no, end - block_no, POSIX_FADV_WILLNEED);
+    }
+
+    free(extents);
+#endif
+}
+
+/* Part of a file.  Offsets count packed characters, 384 to a block, in text and
+   binary files, and bytes, 512 to a block, in image files.  The block holding any
+   offset is known without looking at the file, so only the blocks covering the
+   range are read.  Text is filtered after the range is cut out of it, so a text
+   range can come out shorter than asked for.
+*/
+typedef struct {
+    unsigned long long start;
+    unsigned long long length;
+} range_t;
+
+typedef struct {
+    filename_type_t type;
+    FILE *output;
+    unsigned first_block;
+    unsigned long long start;
+    unsigned long long end;
+    bool eof_p;
+    bool error_p;
+} range_stream_t;
+
+bool write_range_run(unsigned block_no, unsigned count, os8_block_t *blocks, bool hole_p,
+                     void *ctx)
+{
+    range_stream_t *stream = ctx;
+    unsigned unit = stream->type == unknown_type ? OS8_BLOCK_SIZE * 2 : CHARS_PER_BLOCK;
+    unsigned long long run_start = (unsigned long long)(block_no - stream->first_block) * unit;
+    char chars[SCAN_CHUNK * CHARS_PER_BLOCK];
+    char *data = (char *)blocks;
+    bool eof_p;
+
+    if (stream->type != unknown_type) {
+        unpack_chars(blocks[0], count, binary_type, chars, &eof_p);
+        data = chars;
+    }
+
+    size_t from = stream->start > run_start ? stream->start - run_start : 0;
+    size_t to = MIN(stream->end - run_start, (unsigned long long)count * unit);
+    size_t length = to - from;
+    if (stream->type == text_type) {
+        length = filter_text_chars(data + from, length, &stream->eof_p);
+    }
+    if (fwrite(data + from, 1, length, stream->output) != length) {
+        stream->error_p = true;
+        return false;
+    }
+    return !stream->eof_p;
+}
+
+bool stream_os8_range(entry_t entry, filename_type_t type, int os8_file, codec_t codec,
+                      range_t range, FILE *output)
+{
+    unsigned unit = type == unknown_type ? OS8_BLOCK_SIZE * 2 : CHARS_PER_BLOCK;
+    unsigned long long file_size = (unsigned long long)entry.length * unit;
+
+    if (range.start >= file_size || range.length == 0) {
+        return true;
+    }
+
+    unsigned long long end = MIN(range.start + range.length, file_size);
+    unsigned first = range.start / unit;
+    unsigned last = (end - 1) / unit;
+    range_stream_t stream = {type, output, entry.file_block + first,
+                             range.start - (unsigned long long)first * unit,
+                             end - (unsigned long long)first * unit, false, false};
+
+    return read_runs(os8_file, codec, entry.file_block + first, last - first + 1,
+                     &write_range_run, &stream) || (stream.eof_p && !stream.error_p);
+}
+
+bool stream_os8_file(entry_t entry, filename_type_t type, int os8_file, codec_t codec,
+                     FILE *output)
+{
+    switch (type) {
+    case text_type:
+    case binary_type:
+        return stream_os8_byte_file(entry, type, os8_file, codec, output);
+    case unknown_type:
+        return stream_os8_image_file(entry, os8_file, codec, output);
+    }
+    return false;
+}
+
+#define STDOUT_BUFFER_SIZE (1024 * 1024)
+
+/* Stream every matching file to stdout, one after the other, each in the way its
+   extension (or --text or --image) says.  If range isn't NULL only that part of
+   each file is written.
+*/
+bool print_os8_files(char **argv, int first, int last, int os8_file, codec_t codec,
+                     copy_mode_t mode, range_t *range, directory_t directory)
+{
+    setvbuf(stdout, NULL, _IOFBF, STDOUT_BUFFER_SIZE);
+    if (range == NULL) {
+        prefetch_os8_files(argv, first, last + 1, os8_file, codec, directory);
+    }
+
+    for (int i = first; i <= last; i++) {
+        cursor_t cursor;
+        entry_t entry;
+        bool found_p = false;
+
+        init_cursor(directory, &cursor);
+        while (lookup(argv[i], directory, &cursor, &entry)) {
+            os8_filename_t filename;
+            get_filename(entry.name, filename);
+            found_p = true;
+            filename_type_t type = copy_type(filename, mode);
+            if (!(range == NULL ?
+                  stream_os8_file(entry, type, os8_file, codec, stdout) :
+                  stream_os8_range(entry, type, os8_file, codec, *range, stdout))) {
+                fflush(stdout);
+                fprintf(stderr, "Error reading OS/8 file %s\n", filename);
+                return false;
+            }
+        }
+        if (!found_p) {
+            fflush(stdout);
+            fprintf(stderr, "OS/8 file %s not found\n", strip_device(argv[i]));
+            return false;
+        }
+    }
+    return fflush(stdout) == 0;
+}
+
+bool copy_os8_files(char **argv, int first, int last, int os8_file,
+                    codec_t codec, copy_mode_t mode, directory_t directory)
+
+/* We are guaranteed that the last file is a path to an existing host directory
+   for a possibly non-existing file, and that the first through last-1 files are
+   all OS/8 file names.
+*/
+{
+    int fd;
+    struct stat stat_buf;
+    bool is_dir_p;
+
+    if ((fd = open(argv[last], O_RDONLY)) != -1) {
+        if (fstat(fd, &stat_buf) == -1) {
+            perror("stat");
+            return false;
+        }
+        is_dir_p = S_ISDIR(stat_buf.st_mode);
+    }
+
+    /* We will only copy multiple files to a directory, just like the "cp" command
+       in Unix-like systems.  If there is a single source file which contains wildcard
+       characters we assume it will match multiple files.
+    */
+
+    if ((last - first > 1 ||
+         (last - first == 1 && os8_contains_wildcard_p(argv[first]))) &&
+        !is_dir_p) {
+        printf("Output file must be an existing host directory\n");
+        return false;
+    }
+
+    close(fd);
+
+    prefetch_os8_files(argv, first, last, os8_file, codec, directory);
+
+    for (int i = first; i < last; i++) {
+        cursor_t cursor;
+        entry_t entry;
+
+        init_cursor(directory, &cursor);
         while (lookup(argv[i], directory, &cursor, &entry)) {
             char output_path[PATH_MAX + 10] = {'\0'};
             os8_filename_t filename;
-            strncat(output_path, argv[last], PATH_MAX);
-            get_filename(entry.name, filename);
+            strncat(output_path, argv[last], PATH_MAX);
+            get_filename(entry.name, filename);
+
+            if (is_dir_p) {
+                strcat(output_path, "/");
+                strcat(output_path, filename);
+            } 
+
+            filename_type_t type = copy_type(filename, mode);
+            FILE *output;
+            if ((output = fopen(output_path, type == text_type ? "w" : "wb")) == NULL) {
+                perror("Error opening output file:");
+                return false;
+            }
+
+            bool error_p = !stream_os8_file(entry, type, os8_file, codec, output);
+
+            fclose(output);
+
+            if (error_p) {
+                printf("Error copying OS/8 file %s to %s\n", filename, output_path);
+                return false;
+            }
+        }
+    } 
+    return true;
+}
+
+/* The OS/8 name for a host file copied to target, which is either "os8:" for the
+   host file's own name or a specific OS/8 file.
+*/
+bool host_output_name(char *host_name, char *target, os8_filename_t outputname)
+{
+    outputname[0] = '\0';
+    if (os8_devicename_p(target)) {
+        char *path = strdup(host_name);
+        char *base = basename(path);
+        if (!os8_filename_p(base)) {
+            printf("\"%s\" is not a legal OS/8 filename\n", path);
+            return false;
+        }
+        strcat(outputname, base);
+    } else {
+        strcat(outputname, strip_device(target));
+    }
+    return true;
+}
+
+bool copy_host_files(char **argv, int first, int last, int os8_file,
+                    block_io_t write_block, verify_t *verify, copy_mode_t mode,
+                    directory_t directory)
+
+/* Copy from the host to the OS/8 device  image file.
+
+   We are guaranteed that the last argument is a legal OS/8 device or
+   file spec.
+
+   If there is only one file to copy we can copy to a specific s8 file, otherwise the
+   target argument must be "os8:".
+
+   A host file named "-" is stdin, which has no name of its own so it needs a
+   specific OS/8 file, whose extension also decides how it is copied.
+*/
+{
+    /* We will only copy multiple files to "os8:", just like the "cp" command
+       in Unix-like systems.
+    */
+
+    if ((last - first > 1 && !os8_devicename_p(argv[last]))) {
+        printf("Output file must be \"os8\"\n");
+        return false;
+    }
+
+    bool error_p = false;
+    filename_type_t type;
+
+    for (int i = first; i < last && !error_p; i++) {
+        bool stdin_p = strcmp(argv[i], "-") == 0;
+
+        if (stdin_p && os8_devicename_p(argv[last])) {
+            printf("Copying from stdin needs an OS/8 file name\n");
+            return false;
+        }
+
+        type = copy_type(stdin_p ? argv[last] : argv[i], mode);
+        FILE *input;
+        if (stdin_p) {
+            input = stdin;
+        } else if ((input = fopen(argv[i], type == text_type ? "r" : "rb")) == NULL) {
+            perror("Error opening input file:");
+            return false;
+        }
+
+        struct stat stat_buf;
+
+        if (fstat(fileno(input), &stat_buf) == -1) {
+            perror("stat of host file failed:");
+            return false;
+        }
+
+        /* pipes and the like have no size we can use */
+        off_t size = S_ISREG(stat_buf.st_mode) ? stat_buf.st_size : 0;
+
+        os8_filename_t outputname;
+        if (!host_output_name(argv[i], argv[last], outputname)) {
+            return false;
+        }
+
+        switch (type) {
+        case text_type:
+        case binary_type:
+            error_p = !stream_host_char_file(input, type, os8_file,  write_block, verify,
+                                             directory, outputname, size);
+            break;
+        case unknown_type:
+            error_p = !stream_host_image_file(input, os8_file,  write_block, verify,
+                                              directory, outputname, size);
+            break;
+        }
+
+        if (!stdin_p) {
+            fclose(input);
+        }
+
+        if (error_p) {
+            printf("Error copying host file %s to OS/8 file %s\n", argv[i], outputname);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool delete_os8_files(char **argv, int first, int last, bool quiet_p, directory_t directory)
+
+/* We are guaranteed that all of the files on the command line are os8 files,
+   possibly wildcarded.
+
+   In theory one could track everything in a single pass but it is simpler to
+   delete files and fix the directory structure for each file.  So that's what
+   we do.
+*/
+{
+    int deleted_files = 0;
+    for (int i = first; i <= last; i++) {
+        cursor_t cursor;
+        entry_t entry;
+        init_cursor(directory, &cursor);
+        pattern_t pattern;
+
+        build_pattern(strip_device(argv[i]), &pattern);
+
+        while (valid_entry(&cursor)) {
+            peek_entry(cursor, &entry);
+            if (!entry.empty_file && entry.length != 0 &&
+                pattern_match_p(entry.name, pattern)) {
+                bool delete_file_p = true;
+                if (!quiet_p) {
+                    os8_filename_t filename;
+                    get_filename(entry.name, filename);
+                    printf("Delete file %s?", filename);
+                    delete_file_p = yes_no("");
+                }
+                if (delete_file_p) {
+                    delete_entry(&entry);
+                    deleted_files++;
+                }
+            }
+            advance_cursor(&cursor, entry);
+        }
+    }
+
+    consolidate(directory);
+
+    printf("%d files deleted\n", deleted_files);
+    return true;
+}
+
+
+/* Compressed images.  A .gz or .zst image is decompressed into an anonymous
+   in-memory file when it is opened, so the codecs see an ordinary image, and is
+   compressed back over the original only if the command changed it.
+*/
+
+typedef enum {no_compression, gzip_compression, zstd_compression} compression_t;
+
+#define COMPRESSION_CHUNK 65536
+
+/* Returns the compression used by filename, setting *length to the length of
+   the name without the compression suffix.
+*/
+compression_t compression_from_name(const_str_t filename, size_t *length)
+{
+    size_t filename_length = strlen(filename);
+
+    *length = filename_length;
+    if (filename_length > 3 && strcmp(filename + filename_length - 3, ".gz") == 0) {
+        *length -= 3;
+        return gzip_compression;
+    }
+    if (filename_length > 4 && strcmp(filename + filename_length - 4, ".zst") == 0) {
+        *length -= 4;
+        return zstd_compression;
+    }
+    return no_compression;
+}
+
+int anonymous_file()
+{
+    int fd;
+#ifdef MFD_CLOEXEC
+    if ((fd = memfd_create("os8pip", MFD_CLOEXEC)) != -1) {
+        return fd;
+    }
+#endif
+    FILE *t;
+    if ((t = tmpfile()) == NULL) {
+        return -1;
+    }
+    fd = dup(fileno(t));
+    fclose(t);
+    return fd;
+}
+
+bool write_all(int fd, const void *buffer, size_t length)
+{
+    const char *p = buffer;
+    while (length > 0) {
+        ssize_t bytes = write(fd, p, length);
+        if (bytes <= 0) {
+            return false;
+        }
+        p += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+bool decompress_image(int compressed_file, compression_t compression, int image_file)
+{
+    switch (compression) {
+    case gzip_compression: {
+#ifdef HAVE_ZLIB
+        gzFile gz;
+        int fd = dup(compressed_file);
+        if (fd == -1 || (gz = gzdopen(fd, "rb")) == NULL) {
+            return false;
+        }
+        char buffer[COMPRESSION_CHUNK];
+        int bytes;
+        while ((bytes = gzread(gz, buffer, sizeof(buffer))) > 0) {
+            if (!write_all(image_file, buffer, bytes)) {
+                gzclose(gz);
+                return false;
+            }
+        }
+        gzclose(gz);
+        return bytes == 0;
+#else
+        printf("os8pip was built without zlib, rebuild with -DHAVE_ZLIB -lz\n");
+        return false;
+#endif
+    }
+
+    case zstd_compression: {
+#ifdef HAVE_ZSTD
+        ZSTD_DStream *stream = ZSTD_createDStream();
+        char in[COMPRESSION_CHUNK], out[COMPRESSION_CHUNK];
+        ssize_t bytes;
+        size_t result = 0;
+        bool ok = stream != NULL;
+
+        while (ok && (bytes = read(compressed_file, in, sizeof(in))) > 0) {
+            ZSTD_inBuffer input = {in, bytes, 0};
+            while (ok && input.pos < input.size) {
+                ZSTD_outBuffer output = {out, sizeof(out), 0};
+                result = ZSTD_decompressStream(stream, &output, &input);
+                ok = !ZSTD_isError(result) && write_all(image_file, out, output.pos);
+            }
+        }
+        ZSTD_freeDStream(stream);
+        /* a non-zero result means the last frame was truncated */
+        return ok && bytes == 0 && result == 0;
+#else
+        printf("os8pip was built without zstd, rebuild with -DHAVE_ZSTD -lzstd\n");
+        return false;
+#endif
+    }
+
+    default:
+        return false;
+    }
+}
+
+bool compress_image(int image_file, compression_t compression, int compressed_file)
+{
+    switch (compression) {
+    case gzip_compression: {
+#ifdef HAVE_ZLIB
+        gzFile gz;
+        int fd = dup(compressed_file);
+        if (fd == -1 || (gz = gzdopen(fd, "wb")) == NULL) {
+            return false;
+        }
+        char in[COMPRESSION_CHUNK];
+        off_t offset = 0;
+        ssize_t bytes;
+        while ((bytes = pread(image_file, in, sizeof(in), offset)) > 0) {
+            if (gzwrite(gz, in, bytes) != bytes) {
+                gzclose(gz);
+                return false;
+            }
+            offset += bytes;
+        }
+        return gzclose(gz) == Z_OK && bytes == 0;
+#else
+        return false;
+#endif
+    }
+
+    case zstd_compression: {
+#ifdef HAVE_ZSTD
+        ZSTD_CCtx *context = ZSTD_createCCtx();
+        char in[COMPRESSION_CHUNK], out[COMPRESSION_CHUNK];
+        off_t offset = 0;
+        ssize_t bytes = 0;
+        bool ok = context != NULL;
+        size_t remaining;
+
+        while (ok && (bytes = pread(image_file, in, sizeof(in), offset)) >= 0) {
+            ZSTD_EndDirective mode = bytes == 0 ? ZSTD_e_end : ZSTD_e_continue;
+            ZSTD_inBuffer input = {in, bytes, 0};
+            do {
+                ZSTD_outBuffer output = {out, sizeof(out), 0};
+                remaining = ZSTD_compressStream2(context, &output, &input, mode);
+                ok = !ZSTD_isError(remaining) && write_all(compressed_file, out, output.pos);
+            } while (ok && (mode == ZSTD_e_end ? remaining != 0 : input.pos < input.size));
+            if (bytes == 0) {
+                break;
+            }
+            offset += bytes;
+        }
+        ZSTD_freeCCtx(context);
+        return ok && bytes == 0;
+#else
+        return false;
+#endif
+    }
+
+    default:
+        return false;
+    }
+}
+
+/* Load a compressed image into an anonymous file and return its descriptor.  A
+   newly created compressed image starts out empty.
+*/
+int open_compressed_image(int compressed_file, compression_t compression, bool new_p)
+{
+    int image_file;
+
+    if ((image_file = anonymous_file()) == -1) {
+        perror("Error creating in-memory image");
+        return -1;
+    }
+    if (!new_p && !decompress_image(compressed_file, compression, image_file)) {
+        printf("Error decompressing --os8 file\n");
+        close(image_file);
+        return -1;
+    }
+    return image_file;
+}
+
+/* Replace the compressed image with the contents of image_file.  The new version is
+   written next to the old one and renamed over it so a failure leaves the old
+   one intact.
+*/
+bool save_compressed_image(int image_file, const_str_t filename, compression_t compression)
+{
+    char temp_name[PATH_MAX];
+    struct stat stat_buf;
+    int temp_file;
+
+    snprintf(temp_name, sizeof(temp_name), "%s.XXXXXX", filename);
+    if ((temp_file = mkstemp(temp_name)) == -1) {
+        perror("Error creating compressed image");
+        return false;
+    }
+
+    bool ok = compress_image(image_file, compression, temp_file);
+    if (ok && stat(filename, &stat_buf) == 0) {
+        fchmod(temp_file, stat_buf.st_mode & 07777);
+    }
+    ok = ok && fsync(temp_file) == 0;
+    close(temp_file);
+
+    if (!ok || rename(temp_name, filename) == -1) {
+        printf("Error writing compressed image, %s is unchanged\n", filename);
+        unlink(temp_name);
+        return false;
+    }
+    return true;
+}
+
+bool directory_dirty_p(directory_t directory)
+{
+    for (int i = 0; i < DIR_LENGTH; i++) {
+        if (directory[i].dirty) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* An image can have a sidecar, NAME.os8sum, holding a checksum of each block of
+   the device so --scrub can find blocks that have gone bad without another copy
+   of the image to compare with.  It's optional; --sum makes one, and from then on
+   the blocks written through an image's codec have their checksums updated as
+   they're written.
+
+   The sidecar is OS8SUM_MAGIC and the number of blocks, then a checksum for each
+   block.  Numbers are stored low byte first.
+*/
+#define OS8SUM_MAGIC "OS8SUM1\n"
+#define OS8SUM_SUFFIX ".os8sum"
+#define OS8SUM_SIZE 4
+#define OS8SUM_HEADER_SIZE (sizeof(OS8SUM_MAGIC) - 1 + OS8SUM_SIZE)
+
+void put_le(unsigned char *bytes, uint64_t value, unsigned length)
+{
+    for (unsigned i = 0; i < length; i++) {
+        bytes[i] = value >> (8 * i);
+    }
+}
+
+uint64_t get_le(const unsigned char *bytes, unsigned length)
+{
+    uint64_t value = 0;
+    for (unsigned i = length; i > 0; i--) {
+        value = value << 8 | bytes[i - 1];
+    }
+    return value;
+}
+
+/* A block's checksum is its hash folded down to 32 bits */
+uint32_t block_checksum(os8_block_t block)
+{
+    uint64_t hash = hash_words(HASH_INIT, block, OS8_BLOCK_SIZE);
+    return hash ^ hash >> 32;
+}
+
+/* first is where the filesystem being written starts on the device, the rkb
+   filesystem of an RK05 pack follows rka.
+*/
+typedef struct sidecar {
+    struct sidecar *next;
+    int os8_file;
+    int sum_file;
+    unsigned char *sums;
+    size_t size;
+    unsigned blocks;
+    unsigned first;
+    block_io_t write_block;
+    blocks_io_t write_blocks;
+} sidecar_t;
+
+bool sidecar_name(const_str_t name, char *path)
+{
+    if (snprintf(path, PATH_MAX, "%s%s", name, OS8SUM_SUFFIX) >= PATH_MAX) {
+        printf("%s: name too long\n", name);
+        return false;
+    }
+    return true;
+}
+
+void close_sidecar(sidecar_t *sidecar)
+{
+    munmap(sidecar->sums, sidecar->size);
+    close(sidecar->sum_file);
+}
+
+/* Maps the sidecar of an image of a device with the given number of blocks.  It's
+   not an error for there to be none, *found_p says whether there was.
+*/
+bool open_sidecar(const_str_t name, unsigned blocks, bool write_p, sidecar_t *sidecar,
+                  bool *found_p)
+{
+    char path[PATH_MAX];
+    struct stat stat_buf;
+
+    *found_p = false;
+    if (!sidecar_name(name, path)) {
+        return false;
+    }
+    if ((sidecar->sum_file = open(path, write_p ? O_RDWR : O_RDONLY)) == -1) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        printf("Error opening %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    *found_p = true;
+    sidecar->blocks = blocks;
+    sidecar->size = OS8SUM_HEADER_SIZE + (size_t)blocks * OS8SUM_SIZE;
+    if (fstat(sidecar->sum_file, &stat_buf) == -1) {
+        perror("stat");
+        close(sidecar->sum_file);
+        return false;
+    }
+
+    /* mapping more than the file holds would fault on the missing pages */
+    if (stat_buf.st_size != (off_t)sidecar->size) {
+        printf("%s doesn't match %s, make a new one with --sum\n", path, name);
+        close(sidecar->sum_file);
+        return false;
+    }
+    void *sums = mmap(NULL, sidecar->size, write_p ? PROT_READ | PROT_WRITE : PROT_READ,
+                      MAP_SHARED, sidecar->sum_file, 0);
+    if (sums == MAP_FAILED) {
+        perror("mmap");
+        close(sidecar->sum_file);
+        return false;
+    }
+    sidecar->sums = sums;
+    if (memcmp(sums, OS8SUM_MAGIC, sizeof(OS8SUM_MAGIC) - 1) != 0 ||
+        get_le(sidecar->sums + sizeof(OS8SUM_MAGIC) - 1, OS8SUM_SIZE) != blocks) {
+        printf("%s doesn't match %s, make a new one with --sum\n", path, name);
+        close_sidecar(sidecar);
+        return false;
+    }
+    return true;
+}
+
+unsigned char *block_sum(sidecar_t *sidecar, unsigned block_no)
+{
+    return sidecar->sums + OS8SUM_HEADER_SIZE + (size_t)block_no * OS8SUM_SIZE;
+}
+
+/* Writes to an image with a sidecar go through these, which find the sidecar by
+   the image's file, so --fanout's threads can each be writing their own image.
+*/
+static sidecar_t *sidecars;
+static pthread_mutex_t sidecar_lock = PTHREAD_MUTEX_INITIALIZER;
+
+sidecar_t *find_sidecar(int os8_file)
+{
+    pthread_mutex_lock(&sidecar_lock);
+    sidecar_t *sidecar = sidecars;
+    while (sidecar->os8_file != os8_file) {
+        sidecar = sidecar->next;
+    }
+    pthread_mutex_unlock(&sidecar_lock);
+    return sidecar;
+}
+
+void update_sums(sidecar_t *sidecar, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    for (unsigned i = 0; i < count && sidecar->first + block_no + i < sidecar->blocks; i++) {
+        put_le(block_sum(sidecar, sidecar->first + block_no + i), block_checksum(blocks[i]),
+               OS8SUM_SIZE);
+    }
+}
+
+bool sum_write_blocks(int os8_file, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    sidecar_t *sidecar = find_sidecar(os8_file);
+
+    if (!sidecar->write_blocks(os8_file, block_no, count, blocks)) {
+        return false;
+    }
+    update_sums(sidecar, block_no, count, blocks);
+    return true;
+}
+
+bool sum_write_block(int os8_file, unsigned block_no, os8_block_t block)
+{
+    sidecar_t *sidecar = find_sidecar(os8_file);
+
+    if (!sidecar->write_block(os8_file, block_no, block)) {
+        return false;
+    }
+    update_sums(sidecar, block_no, 1, (os8_block_t *)block);
+    return true;
+}
+
+/* Command line processing and main program */
+
+/* make sure all of the referenced files in the command line are either all
+   OS/8 or all host files.
+*/
+
+/* An open image, everything needed to work on it.  os8_file is the image itself, or
+   an uncompressed copy of it in which case compressed_file is the real thing and
+   holds the lock.
+
+   Images in the dsk layout on little-endian hosts are also mapped, and since the
+   file holds words just as we do the blocks can be used right where they are.
+
+   An image opened for writing that has a sidecar gets a codec whose writers keep
+   the sidecar up to date.
+*/
+typedef struct {
+    const_str_t name;
+    int os8_file;
+    int compressed_file;
+    compression_t compression;
+    format_t format;
+    packed12_header_t packed12_header;
+    codec_t codec;
+    directory_t directory;
+    os8_block_t *view;
+    size_t view_size;
+    unsigned view_first;
+    unsigned view_blocks;
+    sidecar_t *sidecar;
+} os8_image_t;
+
+/* The format a name implies, ignoring any compression suffix */
+format_t image_format(const_str_t name)
+{
+    size_t name_length;
+    compression_from_name(name, &name_length);
+    char image_name[name_length + 1];
+    memcpy(image_name, name, name_length);
+    image_name[name_length] = '\0';
+    return format_from_extension(image_name);
+}
+
+void map_image(os8_image_t *image)
+{
+    struct stat stat_buf;
+
+    image->view = NULL;
+#if HOST_LITTLE_ENDIAN
+    if ((image->format != dsk && image->format != simh_rk05) ||
+        fstat(image->os8_file, &stat_buf) == -1 || stat_buf.st_size == 0) {
+        return;
+    }
+    void *view = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, image->os8_file, 0);
+    if (view == MAP_FAILED) {
+        return;
+    }
+    image->view = view;
+    image->view_size = stat_buf.st_size;
+#endif
+}
+
+bool rk05_image_p(os8_image_t *image)
+{
+    format_t format = image->format == packed12 ? image->packed12_header.format : image->format;
+    return format == rk05 || format == simh_rk05;
+}
+
+/* The size of the whole device, both filesystems of an RK05 pack */
+bool count_image_blocks(os8_image_t *image, unsigned *blocks)
+{
+    struct stat stat_buf;
+
+    if (fstat(image->os8_file, &stat_buf) == -1) {
+        perror("stat");
+        return false;
+    }
+    *blocks = image->format == packed12 ? image->packed12_header.blocks :
+                                          device_blocks(image->format, stat_buf.st_size);
+    return true;
+}
+
+/* Switch between the filesystems of an RK05 pack, reading the directory is up to
+   the caller.
+*/
+bool select_filesystem(os8_image_t *image, rk05_filesystem_t filesystem)
+{
+    if (!get_codec(image->format, filesystem, &image->codec)) {
+        return false;
+    }
+    if (image->view != NULL) {
+        unsigned blocks = image->view_size / sizeof(os8_block_t);
+        image->view_first = image->format == simh_rk05 ? simh_rk05_pack_block(filesystem, 0) : 0;
+        image->view_blocks = blocks > image->view_first ? blocks - image->view_first : 0;
+    }
+    if (image->sidecar != NULL) {
+        image->sidecar->first = filesystem == rkb ? RK05_RKB_OFFSET : 0;
+        image->sidecar->write_block = image->codec.write_block;
+        image->sidecar->write_blocks = image->codec.write_blocks;
+        image->codec.write_block = &sum_write_block;
+        image->codec.write_blocks = &sum_write_blocks;
+    }
+    return true;
+}
+
+/* Works out the format of an open image and sets up its codec */
+bool identify_image(os8_image_t *image, format_t format, rk05_filesystem_t filesystem,
+                    int oflags)
+{
+    struct stat stat_buf;
+
+    if ((oflags & O_CREAT) == 0 && format == dectape) {
+
+        /* If DECTape, is the block 128 or 129 words?  This could be done by
+           inspecting the file for a valid directory under either format but
+           the PDP-8/e DECTape handler checks the file length when a DECTape
+           is mounted, so we will too.  DECTape files with 128 word blocks
+           are no different than standard Simh disk files.
+        */
+
+        if (fstat(image->os8_file, &stat_buf) == -1) {
+            perror("stat");
+            return false;
+        }
+
+        if (stat_buf.st_size == OS8_DECTAPE_LENGTH) {
+            format = dsk;
+        } else if (stat_buf.st_size != DECTAPE_LENGTH) {
+            printf("OS/8 DECtape files must be %i bytes long, generic PDP-8 DECTape files %i bytes long\n",
+                   OS8_DECTAPE_LENGTH, DECTAPE_LENGTH);
+            return false;
+        }
+    }
+
+    if ((oflags & O_CREAT) == 0 && format == rk05) {
+        if (fstat(image->os8_file, &stat_buf) == -1) {
+            perror("stat");
+            return false;
+        }
+        format = detect_rk05_format(stat_buf.st_size);
+    }
+
+    if ((oflags & O_CREAT) == 0 && format == packed12 &&
+        !read_packed12_header(image->os8_file, &image->packed12_header)) {
+        return false;
+    }
+
+    if (filesystem == rkb && format != rk05 && format != simh_rk05 &&
+        (format != packed12 || (image->packed12_header.format != rk05 &&
+                                image->packed12_header.format != simh_rk05))) {
+        printf("--rkb can only be used with RK05 images\n");
+        return false;
+    }
+
+    image->format = format;
+    map_image(image);
+    return select_filesystem(image, filesystem);
+}
+
+bool attach_sidecar(os8_image_t *image, rk05_filesystem_t filesystem)
+{
+    unsigned blocks;
+    bool found_p;
+    sidecar_t *sidecar;
+
+    if ((sidecar = malloc(sizeof(sidecar_t))) == NULL) {
+        perror("malloc");
+        return false;
+    }
+    if (!count_image_blocks(image, &blocks) ||
+        !open_sidecar(image->name, blocks, true, sidecar, &found_p)) {
+        free(sidecar);
+        return false;
+    }
+    if (!found_p) {
+        free(sidecar);
+        return true;
+    }
+    sidecar->os8_file = image->os8_file;
+    pthread_mutex_lock(&sidecar_lock);
+    sidecar->next = sidecars;
+    sidecars = sidecar;
+    pthread_mutex_unlock(&sidecar_lock);
+    image->sidecar = sidecar;
+    return select_filesystem(image, filesystem);
+}
+
+void detach_sidecar(os8_image_t *image)
+{
+    sidecar_t *sidecar = image->sidecar;
+
+    pthread_mutex_lock(&sidecar_lock);
+    sidecar_t **link = &sidecars;
+    while (*link != sidecar) {
+        link = &(*link)->next;
+    }
+    *link = sidecar->next;
+    pthread_mutex_unlock(&sidecar_lock);
+    msync(sidecar->sums, sidecar->size, MS_SYNC);
+    close_sidecar(sidecar);
+    free(sidecar);
+    image->sidecar = NULL;
+}
+
+/* Compressed images are only written back if they were changed */
+bool close_image(os8_image_t *image, bool modified_p)
+{
+    bool ok = true;
+
+    if (image->sidecar != NULL) {
+        detach_sidecar(image);
+    }
+    if (image->view != NULL) {
+        munmap(image->view, image->view_size);
+    }
+    if (image->compression != no_compression) {
+        ok = !modified_p ||
+             save_compressed_image(image->os8_file, image->name, image->compression);
+        close(image->compressed_file);
+    }
+    close(image->os8_file);
+    return ok;
+}
+
+/* Opens, locks and if need be decompresses an image, then identifies it.  The
+   directory is read separately, new images don't have one.
+*/
+bool open_image(os8_image_t *image, const_str_t name, format_t format,
+                rk05_filesystem_t filesystem, int oflags)
+{
+    size_t name_length;
+
+    image->name = name;
+    image->compression = compression_from_name(name, &name_length);
+    image->compressed_file = -1;
+    image->packed12_header = (packed12_header_t){unknown, 0};
+    image->view = NULL;
+    image->sidecar = NULL;
+
+    if ((image->os8_file = open(name, oflags,
+         S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)) == -1) {
+        printf("Error opening %s: %s\n", name, strerror(errno));
+        return false;
+    }
+
+    /* images that are only read can be shared, say to --diff an image with itself */
+    if (flock(image->os8_file,
+              ((oflags & O_ACCMODE) == O_RDONLY ? LOCK_SH : LOCK_EX) | LOCK_NB) == -1) {
+        close(image->os8_file);
+        printf("%s is locked: %s\n", name, strerror(errno));
+        return false;
+    }
+
+    /* Work on an uncompressed copy, keeping the compressed file open to hold the lock */
+    if (image->compression != no_compression) {
+        image->compressed_file = image->os8_file;
+        if ((image->os8_file = open_compressed_image(image->compressed_file, image->compression,
+                                                     (oflags & O_CREAT) != 0)) == -1) {
+            close(image->compressed_file);
+            return false;
+        }
+    }
+
+    if (!identify_image(image, format, filesystem, oflags) ||
+        ((oflags & O_ACCMODE) != O_RDONLY && (oflags & O_CREAT) == 0 &&
+         !attach_sidecar(image, filesystem))) {
+        close_image(image, false);
+        return false;
+    }
+    return true;
+}
+
+bool read_image_directory(os8_image_t *image)
+{
+    if (!read_directory(image->codec.read_blocks, image->os8_file, image->directory)) {
+        printf("Error while reading the directory of %s - are you sure the image file is properly formatted?\n",
+               image->name);
+        return false;
+    }
+    return true;
+}
+
+
+/* Visitors are handed the contents of a file a run of blocks at a time, with no
+   copying to a host file.  The blocks are in our own buffers or, when the image is
+   mapped, right in the image, and are only good until the visitor returns.
+   Returning false stops the visit.
+*/
+typedef bool (*block_visitor_t)(unsigned block_no, unsigned count, os8_block_t *blocks,
+                                void *ctx);
+
+typedef struct {
+    block_visitor_t visitor;
+    void *ctx;
+} visit_t;
+
+bool visit_run(unsigned block_no, unsigned count, os8_block_t *blocks, bool hole_p, void *ctx)
+{
+    visit_t *visit = ctx;
+    return visit->visitor(block_no, count, blocks, visit->ctx);
+}
+
+bool os8_visit_file(os8_image_t *image, entry_t entry, block_visitor_t visitor, void *ctx)
+{
+    if (image->view != NULL && entry.file_block + entry.length <= image->view_blocks) {
+        os8_block_t *blocks = image->view + image->view_first + entry.file_block;
+        return validate_words(entry.file_block, entry.length, blocks) &&
+               visitor(entry.file_block, entry.length, blocks, ctx);
+    }
+
+    visit_t visit = {visitor, ctx};
+    return read_runs(image->os8_file, image->codec, entry.file_block, entry.length,
+                     &visit_run, &visit);
+}
+
+/* Character visitors get text and binary files unpacked, text cleaned up and
+   ending at the ^Z.
+*/
+typedef bool (*char_visitor_t)(char *chars, size_t length, void *ctx);
+
+typedef struct {
+    filename_type_t type;
+    char_visitor_t visitor;
+    void *ctx;
+    bool eof_p;
+    bool error_p;
+} char_visit_t;
+
+bool visit_chars(unsigned block_no, unsigned count, os8_block_t *blocks, void *ctx)
+{
+    char_visit_t *visit = ctx;
+    char chars[SCAN_CHUNK * CHARS_PER_BLOCK];
+
+    for (unsigned i = 0; !visit->eof_p && i < count; i += SCAN_CHUNK) {
+        unsigned run = MIN(SCAN_CHUNK, count - i);
+        size_t length = unpack_chars(blocks[i], run, visit->type, chars, &visit->eof_p);
+        if (!visit->visitor(chars, length, visit->ctx)) {
+            visit->error_p = true;
+            return false;
+        }
+    }
+    return !visit->eof_p;
+}
+
+bool os8_visit_file_chars(os8_image_t *image, entry_t entry, filename_type_t type,
+                          char_visitor_t visitor, void *ctx)
+{
+    char_visit_t visit = {type, visitor, ctx, false, false};
+    return os8_visit_file(image, entry, &visit_chars, &visit) || (visit.eof_p && !visit.error_p);
+}
+
+/* --grep searches text files where they lie, a line at a time, with several threads
+   each taking the next file.  Each file's matches are collected and the lot printed in
+   order once every file is done, so the output doesn't depend on the timing.
+*/
+
+typedef struct {
+    entry_t entry;
+    os8_filename_t filename;
+    char *matches;
+    size_t matches_size;
+    bool ok;
+} grep_file_t;
+
+typedef struct {
+    os8_image_t *image;
+    regex_t *regex;
+    grep_file_t *files;
+    unsigned count;
+    unsigned next;
+    pthread_mutex_t lock;
+} grep_t;
+
+typedef struct {
+    grep_t *grep;
+    grep_file_t *file;
+    FILE *output;
+    char *line;
+    size_t length;
+    size_t capacity;
+    unsigned line_no;
+} grep_line_t;
+
+bool grep_line(grep_line_t *state)
+{
+    if (state->length == state->capacity) {
+        char *line = realloc(state->line, state->capacity + 1);
+        if (line == NULL) {
+            return false;
+        }
+        state->line = line;
+        state->capacity++;
+    }
+    state->line[state->length] = '\0';
+    state->line_no++;
+    if (regexec(state->grep->regex, state->line, 0, NULL, 0) == 0) {
+        fprintf(state->output, "%s:%s:%u:%s\n", state->grep->image->name,
+                state->file->filename, state->line_no, state->line);
+    }
+    state->length = 0;
+    return true;
+}
+
+bool grep_chars(char *chars, size_t length, void *ctx)
+{
+    grep_line_t *state = ctx;
+
+    while (length > 0) {
+        char *newline = memchr(chars, '\n', length);
+        size_t run = newline == NULL ? length : (size_t)(newline - chars);
+
+        if (state->length + run > state->capacity) {
+            size_t capacity = MAX(state->capacity * 2, state->length + run);
+            char *line = realloc(state->line, capacity);
+            if (line == NULL) {
+                perror("realloc");
+                return false;
+            }
+            state->line = line;
+            state->capacity = capacity;
+        }
+        memcpy(state->line + state->length, chars, run);
+        state->length += run;
+        if (newline == NULL) {
+            break;
+        }
+        if (!grep_line(state)) {
+            perror("realloc");
+            return false;
+        }
+        chars += run + 1;
+        length -= run + 1;
+    }
+    return true;
+}
+
+bool grep_file(grep_t *grep, grep_file_t *file)
+{
+    grep_line_t state = {grep, file, NULL, NULL, 0, 0, 0};
+
+    if ((state.output = open_memstream(&file->matches, &file->matches_size)) == NULL) {
+        perror("open_memstream");
+        return false;
+    }
+    bool ok = os8_visit_file_chars(grep->image, file->entry, text_type, &grep_chars, &state) &&
+              (state.length == 0 || grep_line(&state));
+    free(state.line);
+    return fclose(state.output) == 0 && ok;
+}
+
+void *grep_worker(void *ctx)
+{
+    grep_t *grep = ctx;
+
+    while (true) {
+        pthread_mutex_lock(&grep->lock);
+        unsigned i = grep->next++;
+        pthread_mutex_unlock(&grep->lock);
+        if (i >= grep->count) {
+            return NULL;
+        }
+        grep->files[i].ok = grep_file(grep, &grep->files[i]);
+    }
+}
+
+bool grep_os8_files(char **argv, int first, int last, os8_image_t *image,
+                    const_str_t pattern, copy_mode_t mode)
+{
+    regex_t regex;
+    grep_t grep = {image, &regex, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    int error;
+    bool ok = true;
+
+    if ((error = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB)) != 0) {
+        char message[256];
+        regerror(error, &regex, message, sizeof(message));
+        printf("Bad --grep pattern: %s\n", message);
+        return false;
+    }
+
+    /* Everything to search, text files only unless --text */
+    for (int i = first; i <= last; i++) {
+        cursor_t cursor;
+        entry_t entry;
+
+        init_cursor(image->directory, &cursor);
+        while (lookup(argv[i], image->directory, &cursor, &entry)) {
+            grep_file_t file = {entry};
+            get_filename(entry.name, file.filename);
+            if (copy_type(file.filename, mode) != text_type) {
+                continue;
+            }
+            grep_file_t *files = realloc(grep.files, (grep.count + 1) * sizeof(grep_file_t));
+            if (files == NULL) {
+                perror("realloc");
+                free(grep.files);
+                regfree(&regex);
+                return false;
+            }
+            grep.files = files;
+            grep.files[grep.count++] = file;
+        }
+    }
+
+    run_workers(&grep_worker, &grep, grep.count);
+
+    setvbuf(stdout, NULL, _IOFBF, STDOUT_BUFFER_SIZE);
+    for (unsigned i = 0; i < grep.count; i++) {
+        if (grep.files[i].ok) {
+            fwrite(grep.files[i].matches, 1, grep.files[i].matches_size, stdout);
+        } else {
+            fflush(stdout);
+            fprintf(stderr, "Error reading OS/8 file %s\n", grep.files[i].filename);
+            ok = false;
+        }
+        free(grep.files[i].matches);
+    }
+    free(grep.files);
+    regfree(&regex);
+    return fflush(stdout) == 0 && ok;
+}
+
+/* The catalog is an index of every file on every image under a directory, for
+   finding which images have a file and whether their copies are the same.
+
+   It's meant to be mapped and searched in place: a header, the records sorted by
+   name (the sixbit words, as OS/8 has them), then the image paths the records
+   point into.  Records with the same name are sorted by hash, so identical copies
+   come out together.  Everything is in host byte order.
+*/
+#define CATALOG_MAGIC "OS8CAT1\n"
+
+typedef struct {
+    char magic[8];
+    uint64_t count;
+    uint64_t paths_size;
+} catalog_header_t;
+
+typedef struct {
+    name_t name;
+    uint64_t hash;
+    uint32_t path;          /* offset of the image's path */
+    uint16_t blocks;
+    uint8_t partition;      /* 1 for RKB */
+    uint8_t unused;
+} catalog_record_t;
+
+typedef struct {
+    char *path;
+    catalog_record_t *records;
+    unsigned count;
+    bool ok;
+} catalog_image_t;
+
+typedef struct {
+    catalog_image_t *images;
+    unsigned count;
+    unsigned next;
+    pthread_mutex_t lock;
+} catalog_t;
+
+bool hash_blocks(unsigned block_no, unsigned count, os8_block_t *blocks, void *ctx)
+{
+    uint64_t *hash = ctx;
+    *hash = hash_words(*hash, blocks[0], (size_t)count * OS8_BLOCK_SIZE);
+    return true;
+}
+
+bool catalog_partition(os8_image_t *image, uint8_t partition, void *ctx)
+{
+    catalog_image_t *catalog_image = ctx;
+    cursor_t cursor;
+    entry_t entry;
+
+    init_cursor(image->directory, &cursor);
+    while (lookup("*.*", image->directory, &cursor, &entry)) {
+        catalog_record_t record = {{0}, HASH_INIT, 0, entry.length, partition, 0};
+        memcpy(record.name, entry.name, sizeof(name_t));
+        if (!os8_visit_file(image, entry, &hash_blocks, &record.hash)) {
+            return false;
+        }
+        catalog_record_t *records = realloc(catalog_image->records,
+                                            (catalog_image->count + 1) * sizeof(catalog_record_t));
+        if (records == NULL) {
+            perror("realloc");
+            return false;
+        }
+        catalog_image->records = records;
+        catalog_image->records[catalog_image->count++] = record;
+    }
+    return true;
+}
+
+/* Calls visitor with each filesystem of an image, both of an RK05 pack though the
+   RKB one often isn't there.
+*/
+typedef bool (*partition_visitor_t)(os8_image_t *image, uint8_t partition, void *ctx);
+
+bool visit_partitions(const_str_t path, partition_visitor_t visitor, void *ctx)
+{
+    os8_image_t image;
+
+    if (!open_image(&image, path, image_format(path), base, O_RDONLY)) {
+        return false;
+    }
+    bool ok = read_image_directory(&image) && visitor(&image, 0, ctx);
+    if (ok && rk05_image_p(&image) && select_filesystem(&image, rkb) &&
+        read_directory(image.codec.read_blocks, image.os8_file, image.directory)) {
+        ok = visitor(&image, 1, ctx);
+    }
+    close_image(&image, false);
+    return ok;
+}
+
+void *catalog_worker(void *ctx)
+{
+    catalog_t *catalog = ctx;
+
+    while (true) {
+        pthread_mutex_lock(&catalog->lock);
+        unsigned i = catalog->next++;
+        pthread_mutex_unlock(&catalog->lock);
+        if (i >= catalog->count) {
+            return NULL;
+        }
+        catalog->images[i].ok = visit_partitions(catalog->images[i].path, &catalog_partition,
+                                                 &catalog->images[i]);
+    }
+}
+
+/* Every file under a directory whose name says it's an image */
+bool find_images(const_str_t directory_name, catalog_t *catalog)
+{
+    DIR *directory;
+    struct dirent *dirent;
+    struct stat stat_buf;
+    bool ok = true;
+
+    if ((directory = opendir(directory_name)) == NULL) {
+        printf("Error opening %s: %s\n", directory_name, strerror(errno));
+        return false;
+    }
+    while (ok && (dirent = readdir(directory)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        char *path = malloc(strlen(directory_name) + strlen(dirent->d_name) + 2);
+        if (path == NULL) {
+            perror("malloc");
+            ok = false;
+            break;
+        }
+        sprintf(path, "%s/%s", directory_name, dirent->d_name);
+        if (lstat(path, &stat_buf) == -1) {
+            free(path);
+        } else if (S_ISDIR(stat_buf.st_mode)) {
+            ok = find_images(path, catalog);
+            free(path);
+        } else if (!S_ISREG(stat_buf.st_mode) || image_format(path) == unknown) {
+            free(path);
+        } else {
+            catalog_image_t *images = realloc(catalog->images,
+                                              (catalog->count + 1) * sizeof(catalog_image_t));
+            if (images == NULL) {
+                perror("realloc");
+                free(path);
+                ok = false;
+            } else {
+                catalog->images = images;
+                catalog->images[catalog->count++] = (catalog_image_t){path, NULL, 0, false};
+            }
+        }
+    }
+    closedir(directory);
+    return ok;
+}
+
+int compare_names(const name_t a, const name_t b)
+{
+    for (unsigned i = 0; i < 4; i++) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+int compare_image_paths(const void *a, const void *b)
+{
+    return strcmp(((const catalog_image_t *)a)->path, ((const catalog_image_t *)b)->path);
+}
+
+int compare_catalog_records(const void *a, const void *b)
+{
+    const catalog_record_t *record_a = a, *record_b = b;
+    int result = compare_names(record_a->name, record_b->name);
+    if (result != 0) {
+        return result;
+    }
+    if (record_a->hash != record_b->hash) {
+        return record_a->hash < record_b->hash ? -1 : 1;
+    }
+    if (record_a->path != record_b->path) {
+        return record_a->path < record_b->path ? -1 : 1;
+    }
+    return (int)record_a->partition - (int)record_b->partition;
+}
+
+bool write_catalog(catalog_t *catalog, const_str_t index_name)
+{
+    catalog_header_t header = {CATALOG_MAGIC, 0, 0};
+    catalog_record_t *records;
+    bool ok = true;
+
+    for (unsigned i = 0; i < catalog->count; i++) {
+        if (catalog->images[i].ok) {
+            header.count += catalog->images[i].count;
+        }
+    }
+    if ((records = malloc(MAX(header.count, 1) * sizeof(catalog_record_t))) == NULL) {
+        perror("malloc");
+        return false;
+    }
+
+    /* the path table, in path order */
+    size_t record_cnt = 0;
+    for (unsigned i = 0; i < catalog->count; i++) {
+        catalog_image_t *image = &catalog->images[i];
+        if (!image->ok) {
+            continue;
+        }
+        for (unsigned j = 0; j < image->count; j++) {
+            records[record_cnt] = image->records[j];
+            records[record_cnt++].path = header.paths_size;
+        }
+        header.paths_size += strlen(image->path) + 1;
+    }
+    qsort(records, header.count, sizeof(catalog_record_t), &compare_catalog_records);
+
+    /* written alongside and renamed, so a search never sees half an index */
+    char temp_name[strlen(index_name) + 5];
+    sprintf(temp_name, "%s.new", index_name);
+    int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+        printf("Error creating %s: %s\n", temp_name, strerror(errno));
+        free(records);
+        return false;
+    }
+    ok = write_all(fd, &header, sizeof(header)) &&
+         write_all(fd, records, header.count * sizeof(catalog_record_t));
+    for (unsigned i = 0; ok && i < catalog->count; i++) {
+        if (catalog->images[i].ok) {
+            ok = write_all(fd, catalog->images[i].path, strlen(catalog->images[i].path) + 1);
+        }
+    }
+    free(records);
+    if (close(fd) == -1 || !ok || rename(temp_name, index_name) == -1) {
+        printf("Error writing %s: %s\n", index_name, strerror(errno));
+        unlink(temp_name);
+        return false;
+    }
+    return true;
+}
+
+/* Images that can't be read are reported and left out, rather than giving up on
+   the whole tree.
+*/
+bool build_catalog(const_str_t directory_name, const_str_t index_name)
+{
+    catalog_t catalog = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    bool ok = find_images(directory_name, &catalog);
+
+    if (ok) {
+        qsort(catalog.images, catalog.count, sizeof(catalog_image_t), &compare_image_paths);
+        run_workers(&catalog_worker, &catalog, catalog.count);
+        for (unsigned i = 0; i < catalog.count; i++) {
+            if (!catalog.images[i].ok) {
+                printf("Skipping %s\n", catalog.images[i].path);
+            }
+        }
+        ok = write_catalog(&catalog, index_name);
+    }
+    for (unsigned i = 0; i < catalog.count; i++) {
+        free(catalog.images[i].path);
+        free(catalog.images[i].records);
+    }
+    free(catalog.images);
+    return ok;
+}
+
+/* Maps an index made by build_catalog, checking it's all there */
+bool map_catalog(const_str_t index_name, void **map, size_t *map_size)
+{
+    struct stat stat_buf;
+    catalog_header_t *header;
+    int fd;
+
+    if ((fd = open(index_name, O_RDONLY)) == -1) {
+        printf("Error opening %s: %s\n", index_name, strerror(errno));
+        return false;
+    }
+    if (fstat(fd, &stat_buf) == -1 || stat_buf.st_size < (off_t)sizeof(catalog_header_t) ||
+        (*map = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        printf("%s isn't a catalog\n", index_name);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    *map_size = stat_buf.st_size;
+    header = *map;
+    if (memcmp(header->magic, CATALOG_MAGIC, sizeof(header->magic)) != 0 ||
+        header->count > (*map_size - sizeof(catalog_header_t)) / sizeof(catalog_record_t) ||
+        sizeof(catalog_header_t) + header->count * sizeof(catalog_record_t) +
+        header->paths_size != *map_size ||
+        (header->paths_size != 0 && ((char *)*map)[*map_size - 1] != '\0')) {
+        printf("%s isn't a catalog\n", index_name);
+        munmap(*map, *map_size);
+        return false;
+    }
+    return true;
+}
+
+/* Compares a name with the leading part of a pattern with no wildcards in it,
+   which is what the records matching the pattern all have in common.  Since the
+   records are sorted by name they are all together.
+*/
+int compare_pattern_prefix(const name_t name, pattern_t pattern)
+{
+    for (unsigned i = 0; i < 4 && pattern.mask[i] != 0; i++) {
+        pdp8_word_t a = name[i] & pattern.mask[i], b = pattern.match[i] & pattern.mask[i];
+        if (a != b) {
+            return a < b ? -1 : 1;
+        }
+        if (pattern.mask[i] != 07777) {
+            break;
+        }
+    }
+    return 0;
+}
+
+bool find_catalog(const_str_t filename, const_str_t index_name)
+{
+    void *map;
+    size_t map_size;
+    pattern_t pattern;
+
+    if (!map_catalog(index_name, &map, &map_size)) {
+        return false;
+    }
+    catalog_header_t *header = map;
+    catalog_record_t *records = (catalog_record_t *)(header + 1);
+    char *paths = (char *)(records + header->count);
+
+    build_pattern(strip_device(filename), &pattern);
+
+    /* the first record with the prefix */
+    size_t low = 0, high = header->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (compare_pattern_prefix(records[middle].name, pattern) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    setvbuf(stdout, NULL, _IOFBF, STDOUT_BUFFER_SIZE);
+    for (size_t i = low; i < header->count && compare_pattern_prefix(records[i].name, pattern) == 0; i++) {
+        if (pattern_match_p(records[i].name, pattern) && records[i].path < header->paths_size) {
+            os8_filename_t name;
+            get_filename(records[i].name, name);
+            printf("%-10s %5u  %016llx  %s%s\n", name, records[i].blocks,
+                   (unsigned long long)records[i].hash, paths + records[i].path,
+                   records[i].partition ? " (RKB)" : "");
+        }
+    }
+    munmap(map, map_size);
+    return fflush(stdout) == 0;
+}
+
+/* The word index lists every line of every text file on the images under a
+   directory that each word appears on, so finding a word needs no images at all.
+   A word is a run of letters and digits, folded to upper case as OS/8 would have
+   it, and only the first TOKEN_SIZE - 1 characters count.
+
+   Like the catalog it's searched where it's mapped: a header, the words sorted
+   with where their lines start in the list of lines, the files, the lines
+   themselves (sorted by word, file and line), then the words and image paths.
+   All in host byte order.
+*/
+#define WORD_INDEX_MAGIC "OS8WRD1\n"
+#define TOKEN_SIZE 32
+#define MIN_TOKEN_LENGTH 2
+
+typedef struct {
+    char magic[8];
+    uint32_t words;
+    uint32_t files;
+    uint32_t lines;
+    uint32_t strings_size;
+} word_index_header_t;
+
+typedef struct {
+    uint32_t string;
+    uint32_t first_line;
+    uint32_t line_count;
+} word_record_t;
+
+typedef struct {
+    uint32_t path;
+    name_t name;
+    uint8_t partition;
+    uint8_t unused[3];
+} word_file_t;
+
+typedef struct {
+    uint32_t file;
+    uint32_t line;
+} word_line_t;
+
+/* While building, each occurrence of a word carries the word */
+typedef struct {
+    char token[TOKEN_SIZE];
+    uint32_t file;
+    uint32_t line;
+} occurrence_t;
+
+typedef struct {
+    char *path;
+    word_file_t *files;
+    unsigned file_count;
+    occurrence_t *occurrences;
+    size_t occurrence_count;
+    size_t occurrence_capacity;
+    bool ok;
+} word_image_t;
+
+typedef struct {
+    word_image_t *images;
+    unsigned count;
+    unsigned next;
+    pthread_mutex_t lock;
+} word_index_t;
+
+typedef struct {
+    word_image_t *image;
+    uint32_t file;
+    uint32_t line;
+    char token[TOKEN_SIZE];
+    unsigned length;
+} tokenizer_t;
+
+bool end_token(tokenizer_t *tokenizer)
+{
+    word_image_t *image = tokenizer->image;
+
+    if (tokenizer->length >= MIN_TOKEN_LENGTH) {
+        if (image->occurrence_count == image->occurrence_capacity) {
+            size_t capacity = MAX(image->occurrence_capacity * 2, 1024);
+            occurrence_t *occurrences = realloc(image->occurrences,
+                                                capacity * sizeof(occurrence_t));
+            if (occurrences == NULL) {
+                perror("realloc");
+                return false;
+            }
+            image->occurrences = occurrences;
+            image->occurrence_capacity = capacity;
+        }
+        occurrence_t *occurrence = &image->occurrences[image->occurrence_count++];
+        memset(occurrence->token, 0, TOKEN_SIZE);
+        memcpy(occurrence->token, tokenizer->token, tokenizer->length);
+        occurrence->file = tokenizer->file;
+        occurrence->line = tokenizer->line;
+    }
+    tokenizer->length = 0;
+    return true;
+}
+
+bool tokenize_chars(char *chars, size_t length, void *ctx)
+{
+    tokenizer_t *tokenizer = ctx;
+
+    for (size_t i = 0; i < length; i++) {
+        if (isalnum((unsigned char)chars[i])) {
+            if (tokenizer->length < TOKEN_SIZE - 1) {
+                tokenizer->token[tokenizer->length++] = toupper((unsigned char)chars[i]);
+            }
+            continue;
+        }
+        if (!end_token(tokenizer)) {
+            return false;
+        }
+        if (chars[i] == '\n') {
+            tokenizer->line++;
+        }
+    }
+    return true;
+}
+
+int compare_occurrences(const void *a, const void *b)
+{
+    const occurrence_t *occurrence_a = a, *occurrence_b = b;
+    int result = strcmp(occurrence_a->token, occurrence_b->token);
+    if (result != 0) {
+        return result;
+    }
+    if (occurrence_a->file != occurrence_b->file) {
+        return occurrence_a->file < occurrence_b->file ? -1 : 1;
+    }
+    return occurrence_a->line < occurrence_b->line ? -1 : occurrence_a->line > occurrence_b->line;
+}
+
+/* A word showing up more than once on a line counts once */
+size_t unique_occurrences(occurrence_t *occurrences, size_t count)
+{
+    size_t unique = 0;
+
+    qsort(occurrences, count, sizeof(occurrence_t), &compare_occurrences);
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || compare_occurrences(&occurrences[unique - 1], &occurrences[i]) != 0) {
+            occurrences[unique++] = occurrences[i];
+        }
+    }
+    return unique;
+}
+
+bool index_partition(os8_image_t *image, uint8_t partition, void *ctx)
+{
+    word_image_t *word_image = ctx;
+    cursor_t cursor;
+    entry_t entry;
+
+    init_cursor(image->directory, &cursor);
+    while (lookup("*.*", image->directory, &cursor, &entry)) {
+        os8_filename_t filename;
+        get_filename(entry.name, filename);
+        if (filename_type(filename) != text_type) {
+            continue;
+        }
+        word_file_t *files = realloc(word_image->files,
+                                     (word_image->file_count + 1) * sizeof(word_file_t));
+        if (files == NULL) {
+            perror("realloc");
+            return false;
+        }
+        word_image->files = files;
+        word_file_t *file = &word_image->files[word_image->file_count];
+        memset(file, 0, sizeof(word_file_t));
+        memcpy(file->name, entry.name, sizeof(name_t));
+        file->partition = partition;
+
+        tokenizer_t tokenizer = {word_image, word_image->file_count++, 1, "", 0};
+        if (!os8_visit_file_chars(image, entry, text_type, &tokenize_chars, &tokenizer) ||
+            !end_token(&tokenizer)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void *word_index_worker(void *ctx)
+{
+    word_index_t *index = ctx;
+
+    while (true) {
+        pthread_mutex_lock(&index->lock);
+        unsigned i = index->next++;
+        pthread_mutex_unlock(&index->lock);
+        if (i >= index->count) {
+            return NULL;
+        }
+        word_image_t *image = &index->images[i];
+        image->ok = visit_partitions(image->path, &index_partition, image);
+        image->occurrence_count = unique_occurrences(image->occurrences, image->occurrence_count);
+    }
+}
+
+bool add_string(char **strings, uint32_t *size, const_str_t string, uint32_t *offset)
+{
+    size_t length = strlen(string) + 1;
+    char *grown = realloc(*strings, *size + length);
+
+    if (grown == NULL || *size + length > UINT32_MAX) {
+        printf("Word index too large\n");
+        return false;
+    }
+    *strings = grown;
+    memcpy(*strings + *size, string, length);
+    *offset = *size;
+    *size += length;
+    return true;
+}
+
+bool write_word_index(word_index_t *index, const_str_t index_name)
+{
+    word_index_header_t header = {WORD_INDEX_MAGIC, 0, 0, 0, 0};
+    size_t occurrence_count = 0;
+    occurrence_t *occurrences;
+    word_file_t *files;
+    char *strings = NULL;
+    bool ok = true;
+
+    for (unsigned i = 0; i < index->count; i++) {
+        if (index->images[i].ok) {
+            occurrence_count += index->images[i].occurrence_count;
+            header.files += index->images[i].file_count;
+        }
+    }
+    if (occurrence_count > UINT32_MAX) {
+        printf("Word index too large\n");
+        return false;
+    }
+    occurrences = malloc(MAX(occurrence_count, 1) * sizeof(occurrence_t));
+    files = malloc(MAX(header.files, 1) * sizeof(word_file_t));
+    if (occurrences == NULL || files == NULL) {
+        perror("malloc");
+        free(occurrences);
+        free(files);
+        return false;
+    }
+
+    /* gather the files and their words, numbering the files across every image */
+    uint32_t file_cnt = 0;
+    size_t occurrence_cnt = 0;
+    for (unsigned i = 0; ok && i < index->count; i++) {
+        word_image_t *image = &index->images[i];
+        uint32_t path;
+        if (!image->ok || image->file_count == 0) {
+            continue;
+        }
+        ok = add_string(&strings, &header.strings_size, image->path, &path);
+        for (unsigned j = 0; j < image->file_count; j++) {
+            files[file_cnt + j] = image->files[j];
+            files[file_cnt + j].path = path;
+        }
+        for (size_t j = 0; j < image->occurrence_count; j++) {
+            occurrences[occurrence_cnt] = image->occurrences[j];
+            occurrences[occurrence_cnt++].file += file_cnt;
+        }
+        file_cnt += image->file_count;
+    }
+    /* only what was gathered, all of them unless add_string failed part way */
+    qsort(occurrences, occurrence_cnt, sizeof(occurrence_t), &compare_occurrences);
+
+    /* and then the words, each with its run of lines */
+    word_record_t *words = malloc(MAX(occurrence_count, 1) * sizeof(word_record_t));
+    word_line_t *lines = malloc(MAX(occurrence_count, 1) * sizeof(word_line_t));
+    if (words == NULL || lines == NULL) {
+        perror("malloc");
+        ok = false;
+    }
+    for (size_t i = 0; ok && i < occurrence_count; i++) {
+        if (i == 0 || strcmp(occurrences[i - 1].token, occurrences[i].token) != 0) {
+            word_record_t *word = &words[header.words++];
+            ok = add_string(&strings, &header.strings_size, occurrences[i].token, &word->string);
+            word->first_line = i;
+            word->line_count = 0;
+        }
+        words[header.words - 1].line_count++;
+        lines[i] = (word_line_t){occurrences[i].file, occurrences[i].line};
+    }
+    header.lines = occurrence_count;
+    free(occurrences);
+
+    char temp_name[strlen(index_name) + 5];
+    sprintf(temp_name, "%s.new", index_name);
+    int fd = -1;
+    if (ok && (fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC,
+                         S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+        printf("Error creating %s: %s\n", temp_name, strerror(errno));
+        ok = false;
+    }
+    if (ok) {
+        ok = write_all(fd, &header, sizeof(header)) &&
+             write_all(fd, words, header.words * sizeof(word_record_t)) &&
+             write_all(fd, files, header.files * sizeof(word_file_t)) &&
+             write_all(fd, lines, header.lines * sizeof(word_line_t)) &&
+             write_all(fd, strings, header.strings_size);
+        if (close(fd) == -1 || !ok || rename(temp_name, index_name) == -1) {
+            printf("Error writing %s: %s\n", index_name, strerror(errno));
+            unlink(temp_name);
+            ok = false;
+        }
+    }
+    free(words);
+    free(lines);
+    free(files);
+    free(strings);
+    return ok;
+}
+
+bool build_word_index(const_str_t directory_name, const_str_t index_name)
+{
+    catalog_t catalog = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    word_index_t index = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    bool ok = find_images(directory_name, &catalog);
+
+    if (ok && (index.images = calloc(MAX(catalog.count, 1), sizeof(word_image_t))) == NULL) {
+        perror("calloc");
+        ok = false;
+    }
+    if (ok) {
+        qsort(catalog.images, catalog.count, sizeof(catalog_image_t), &compare_image_paths);
+        for (unsigned i = 0; i < catalog.count; i++) {
+            index.images[i].path = catalog.images[i].path;
+        }
+        index.count = catalog.count;
+        run_workers(&word_index_worker, &index, index.count);
+        for (unsigned i = 0; i < index.count; i++) {
+            if (!index.images[i].ok) {
+                printf("Skipping %s\n", index.images[i].path);
+            }
+        }
+        ok = write_word_index(&index, index_name);
+    }
+    for (unsigned i = 0; i < index.count; i++) {
+        free(index.images[i].files);
+        free(index.images[i].occurrences);
+    }
+    for (unsigned i = 0; i < catalog.count; i++) {
+        free(catalog.images[i].path);
+    }
+    free(index.images);
+    free(catalog.images);
+    return ok;
+}
+
+bool find_word(const_str_t word, const_str_t index_name)
+{
+    struct stat stat_buf;
+    void *map = MAP_FAILED;
+    int fd;
+
+    if ((fd = open(index_name, O_RDONLY)) == -1) {
+        printf("Error opening %s: %s\n", index_name, strerror(errno));
+        return false;
+    }
+    if (fstat(fd, &stat_buf) != -1 && stat_buf.st_size >= (off_t)sizeof(word_index_header_t)) {
+        map = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    /* check it's all there before believing any of it */
+    word_index_header_t *header = map;
+    size_t size = stat_buf.st_size;
+    if (map == MAP_FAILED ||
+        memcmp(header->magic, WORD_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        sizeof(word_index_header_t) + (uint64_t)header->words * sizeof(word_record_t) +
+        (uint64_t)header->files * sizeof(word_file_t) +
+        (uint64_t)header->lines * sizeof(word_line_t) + header->strings_size != size ||
+        (header->strings_size != 0 && ((char *)map)[size - 1] != '\0')) {
+        printf("%s isn't a word index\n", index_name);
+        if (map != MAP_FAILED) {
+            munmap(map, size);
+        }
+        return false;
+    }
+    word_record_t *words = (word_record_t *)(header + 1);
+    word_file_t *files = (word_file_t *)(words + header->words);
+    word_line_t *lines = (word_line_t *)(files + header->files);
+    char *strings = (char *)(lines + header->lines);
+
+    char token[TOKEN_SIZE] = "";
+    for (unsigned i = 0; i < TOKEN_SIZE - 1 && word[i] != '\0'; i++) {
+        token[i] = toupper((unsigned char)word[i]);
+    }
+
+    size_t low = 0, high = header->words;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (words[middle].string >= header->strings_size ||
+            strcmp(strings + words[middle].string, token) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    setvbuf(stdout, NULL, _IOFBF, STDOUT_BUFFER_SIZE);
+    if (low < header->words && words[low].string < header->strings_size &&
+        strcmp(strings + words[low].string, token) == 0 &&
+        (uint64_t)words[low].first_line + words[low].line_count <= header->lines) {
+        for (uint32_t i = 0; i < words[low].line_count; i++) {
+            word_line_t *line = &lines[words[low].first_line + i];
+            if (line->file >= header->files || files[line->file].path >= header->strings_size) {
+                continue;
+            }
+            os8_filename_t filename;
+            get_filename(files[line->file].name, filename);
+            printf("%s%s:%s:%u\n", strings + files[line->file].path,
+                   files[line->file].partition ? " (RKB)" : "", filename, line->line);
+        }
+    }
+    munmap(map, size);
+    return fflush(stdout) == 0;
+}
+
+/* --diff compares the directories of two images, which may be in different formats,
+   matching files by name.  Only the files found in both with the same length have
+   their contents compared, by hashing them.  With --blocks the whole devices are
+   compared instead, block by block.
+
+   Differences are printed as they're found; *differ_p says whether there were any.
+*/
+typedef struct {
+    entry_t entry;
+    bool matched_p;
+} diff_file_t;
+
+bool list_files(directory_t directory, diff_file_t **files, unsigned *count)
+{
+    cursor_t cursor;
+    entry_t entry;
+
+    *files = NULL;
+    *count = 0;
+    init_cursor(directory, &cursor);
+    while (lookup("*.*", directory, &cursor, &entry)) {
+        diff_file_t *grown = realloc(*files, (*count + 1) * sizeof(diff_file_t));
+        if (grown == NULL) {
+            perror("realloc");
+            return false;
+        }
+        *files = grown;
+        (*files)[(*count)++] = (diff_file_t){entry, false};
+    }
+    return true;
+}
+
+bool diff_directories(os8_image_t *image, os8_image_t *other, bool *differ_p)
+{
+    diff_file_t *files = NULL, *other_files = NULL;
+    unsigned count, other_count;
+    bool ok = list_files(image->directory, &files, &count) &&
+              list_files(other->directory, &other_files, &other_count);
+
+    for (unsigned i = 0; ok && i < count; i++) {
+        entry_t entry = files[i].entry;
+        os8_filename_t filename;
+        unsigned j = 0;
+
+        get_filename(entry.name, filename);
+        while (j < other_count &&
+               (other_files[j].matched_p || compare_names(entry.name, other_files[j].entry.name) != 0)) {
+            j++;
+        }
+        if (j == other_count) {
+            printf("Only in %s: %s\n", image->name, filename);
+            *differ_p = true;
+            continue;
+        }
+        other_files[j].matched_p = true;
+        entry_t other_entry = other_files[j].entry;
+
+        if (entry.length != other_entry.length) {
+            printf("%s: %u blocks in %s, %u in %s\n", filename,
+                   entry.length, image->name, other_entry.length, other->name);
+            *differ_p = true;
+            continue;
+        }
+
+        uint64_t hash = HASH_INIT, other_hash = HASH_INIT;
+        if (!os8_visit_file(image, entry, &hash_blocks, &hash) ||
+            !os8_visit_file(other, other_entry, &hash_blocks, &other_hash)) {
+            printf("Error reading %s\n", filename);
+            ok = false;
+            break;
+        }
+        if (entry.file_block != other_entry.file_block) {
+            printf("%s: moved from block %u to %u%s\n", filename, entry.file_block,
+                   other_entry.file_block, hash != other_hash ? ", contents differ" : "");
+            *differ_p = true;
+        } else if (hash != other_hash) {
+            printf("%s: contents differ\n", filename);
+            *differ_p = true;
+        }
+    }
+
+    for (unsigned j = 0; ok && j < other_count; j++) {
+        if (!other_files[j].matched_p) {
+            os8_filename_t filename;
+            get_filename(other_files[j].entry.name, filename);
+            printf("Only in %s: %s\n", other->name, filename);
+            *differ_p = true;
+        }
+    }
+    free(files);
+    free(other_files);
+    return ok;
+}
+
+/* Runs of differing blocks are printed as ranges */
+typedef struct {
+    os8_image_t *other;
+    os8_block_t *other_blocks;
+    bool in_range_p;
+    unsigned range_start;
+    bool *differ_p;
+} block_diff_t;
+
+void end_block_range(block_diff_t *diff, unsigned block_no)
+{
+    if (diff->in_range_p) {
+        if (block_no - 1 == diff->range_start) {
+            printf("Block %u differs\n", diff->range_start);
+        } else {
+            printf("Blocks %u-%u differ\n", diff->range_start, block_no - 1);
+        }
+        diff->in_range_p = false;
+    }
+}
+
+bool diff_run(unsigned block_no, unsigned count, os8_block_t *blocks, bool hole_p, void *ctx)
+{
+    block_diff_t *diff = ctx;
+
+    if (!diff->other->codec.read_blocks(diff->other->os8_file, block_no, count,
+                                        diff->other_blocks)) {
+        printf("Error reading block %u of %s\n", block_no, diff->other->name);
+        return false;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (memcmp(blocks[i], diff->other_blocks[i], sizeof(os8_block_t)) == 0) {
+            end_block_range(diff, block_no + i);
+        } else if (!diff->in_range_p) {
+            diff->in_range_p = true;
+            diff->range_start = block_no + i;
+            *diff->differ_p = true;
+        }
+    }
+    return true;
+}
+
+bool diff_blocks(os8_image_t *image, os8_image_t *other, bool *differ_p)
+{
+    unsigned blocks, other_blocks;
+    os8_block_t other_buffer[SCAN_CHUNK];
+    block_diff_t diff = {other, other_buffer, false, 0, differ_p};
+
+    if (!count_image_blocks(image, &blocks) || !count_image_blocks(other, &other_blocks)) {
+        return false;
+    }
+    if (blocks != other_blocks) {
+        printf("%s has %u blocks, %s has %u\n", image->name, blocks, other->name, other_blocks);
+        *differ_p = true;
+    }
+    unsigned common = MIN(blocks, other_blocks);
+    bool ok = read_runs(image->os8_file, image->codec, 0, common, &diff_run, &diff);
+    end_block_range(&diff, common);
+    return ok;
+}
+
+bool diff_images(os8_image_t *image, const_str_t other_name, rk05_filesystem_t filesystem,
+                 bool blocks_p, bool *differ_p)
+{
+    os8_image_t other;
+    format_t format = image_format(other_name);
+
+    if (format == unknown) {
+        printf("Can't tell the format of %s from its name\n", other_name);
+        return false;
+    }
+    if (!open_image(&other, other_name, format, filesystem, O_RDONLY)) {
+        return false;
+    }
+    bool ok = blocks_p ? diff_blocks(image, &other, differ_p) :
+                         read_image_directory(&other) && diff_directories(image, &other, differ_p);
+    close_image(&other, false);
+    return ok;
+}
+
+/* A delta holds the blocks that changed between two images of the same device, to
+   bring copies of the old image up to date without redoing whatever changed it.
+   It's made from and applied to the decoded blocks, so neither image's format
+   matters.
+
+   The header is the magic string, the hash of the image it applies to and the
+   number of blocks in the device, followed by runs of changed blocks in order:
+   the first block, the number of blocks, then the blocks two bytes per word.
+   Numbers are little-endian, so a delta can be applied anywhere.
+*/
+#define DELTA_MAGIC "OS8DLT1\n"
+#define DELTA_HEADER_SIZE 20
+#define DELTA_RUN_HEADER_SIZE 8
+#define DELTA_BLOCK_SIZE (OS8_BLOCK_SIZE * 2)
+
+typedef struct {
+    os8_image_t *new_image;
+    os8_block_t *new_blocks;
+    uint64_t hash;
+    unsigned char *delta;
+    size_t size;
+    size_t capacity;
+    size_t run_header;          /* of the run being added to, 0 if none */
+} delta_t;
+
+bool grow_delta(delta_t *delta, size_t length)
+{
+    if (delta->size + length > delta->capacity) {
+        size_t capacity = MAX(delta->capacity * 2, delta->size + length);
+        unsigned char *grown = realloc(delta->delta, capacity);
+        if (grown == NULL) {
+            perror("realloc");
+            return false;
+        }
+        delta->delta = grown;
+        delta->capacity = capacity;
+    }
+    return true;
+}
+
+bool delta_run(unsigned block_no, unsigned count, os8_block_t *blocks, bool hole_p, void *ctx)
+{
+    delta_t *delta = ctx;
+
+    delta->hash = hash_words(delta->hash, blocks[0], (size_t)count * OS8_BLOCK_SIZE);
+    if (!delta->new_image->codec.read_blocks(delta->new_image->os8_file, block_no, count,
+                                             delta->new_blocks)) {
+        fprintf(stderr, "Error reading block %u of %s\n", block_no, delta->new_image->name);
+        return false;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (memcmp(blocks[i], delta->new_blocks[i], sizeof(os8_block_t)) == 0) {
+            delta->run_header = 0;
+            continue;
+        }
+        if (!grow_delta(delta, DELTA_RUN_HEADER_SIZE + DELTA_BLOCK_SIZE)) {
+            return false;
+        }
+        if (delta->run_header == 0) {
+            delta->run_header = delta->size;
+            put_le(delta->delta + delta->size, block_no + i, 4);
+            put_le(delta->delta + delta->size + 4, 0, 4);
+            delta->size += DELTA_RUN_HEADER_SIZE;
+        }
+        unsigned char *run_count = delta->delta + delta->run_header + 4;
+        put_le(run_count, get_le(run_count, 4) + 1, 4);
+        for (unsigned j = 0; j < OS8_BLOCK_SIZE; j++) {
+            put_le(delta->delta + delta->size + 2 * j, delta->new_blocks[i][j], 2);
+        }
+        delta->size += DELTA_BLOCK_SIZE;
+    }
+    return true;
+}
+
+/* The old image is the one opened with --os8.  The delta goes to delta_file, which
+   was stdout, and stdout has been pointed at stderr so nothing printed along the way
+   can end up in the delta.
+*/
+bool make_image_delta(os8_image_t *image, const_str_t new_name, int delta_file)
+{
+    os8_image_t new_image;
+    os8_block_t new_blocks[SCAN_CHUNK];
+    format_t format = image_format(new_name);
+    unsigned blocks, new_blocks_cnt;
+    delta_t delta = {&new_image, new_blocks, HASH_INIT, NULL, 0, 0, 0};
+
+    if (format == unknown) {
+        fprintf(stderr, "Can't tell the format of %s from its name\n", new_name);
+        return false;
+    }
+    if (isatty(delta_file)) {
+        fprintf(stderr, "The delta is binary, send it to a file or a pipe\n");
+        return false;
+    }
+    if (!open_image(&new_image, new_name, format, base, O_RDONLY)) {
+        return false;
+    }
+    bool ok = count_image_blocks(image, &blocks) &&
+              count_image_blocks(&new_image, &new_blocks_cnt);
+    if (ok && blocks != new_blocks_cnt) {
+        fprintf(stderr, "%s has %u blocks, %s has %u\n", image->name, blocks, new_name,
+                new_blocks_cnt);
+        ok = false;
+    }
+    ok = ok && grow_delta(&delta, DELTA_HEADER_SIZE);
+    if (ok) {
+        delta.size = DELTA_HEADER_SIZE;
+        ok = read_runs(image->os8_file, image->codec, 0, blocks, &delta_run, &delta);
+    }
+    if (ok) {
+        memcpy(delta.delta, DELTA_MAGIC, 8);
+        put_le(delta.delta + 8, delta.hash, 8);
+        put_le(delta.delta + 16, blocks, 4);
+        ok = write_all(delta_file, delta.delta, delta.size);
+    }
+    free(delta.delta);
+    close_image(&new_image, false);
+    return ok;
+}
+
+/* The delta is read whole, "-" is stdin */
+bool read_delta(const_str_t name, unsigned char **delta, size_t *size)
+{
+    FILE *input = strcmp(name, "-") == 0 ? stdin : fopen(name, "rb");
+    size_t capacity = 0;
+    size_t bytes;
+
+    *delta = NULL;
+    *size = 0;
+    if (input == NULL) {
+        printf("Error opening %s: %s\n", name, strerror(errno));
+        return false;
+    }
+    do {
+        if (*size == capacity) {
+            capacity = MAX(capacity * 2, HOST_BUFFER_SIZE);
+            unsigned char *grown = realloc(*delta, capacity);
+            if (grown == NULL) {
+                perror("realloc");
+                break;
+            }
+            *delta = grown;
+        }
+        bytes = fread(*delta + *size, 1, capacity - *size, input);
+        *size += bytes;
+    } while (bytes > 0);
+    bool ok = !ferror(input) && !(*size == capacity && !feof(input));
+    if (input != stdin) {
+        fclose(input);
+    }
+    if (!ok) {
+        printf("Error reading %s\n", name);
+    }
+    return ok;
+}
+
+/* Every run is checked before anything is written, and the runs are in order so
+   the image is written in a single pass.
+*/
+bool apply_image_delta(os8_image_t *image, const_str_t delta_name)
+{
+    unsigned char *delta;
+    size_t size;
+    unsigned blocks;
+    uint64_t hash;
+    bool ok = read_delta(delta_name, &delta, &size) && count_image_blocks(image, &blocks);
+
+    if (ok && (size < DELTA_HEADER_SIZE || memcmp(delta, DELTA_MAGIC, 8) != 0)) {
+        printf("%s isn't a delta\n", delta_name);
+        ok = false;
+    }
+    if (ok && get_le(delta + 16, 4) != blocks) {
+        printf("The delta is for a %u block device, %s has %u blocks\n",
+               (unsigned)get_le(delta + 16, 4), image->name, blocks);
+        ok = false;
+    }
+
+    size_t offset = DELTA_HEADER_SIZE;
+    uint64_t next_block = 0;
+    while (ok && offset < size) {
+        uint64_t block_no = size - offset >= DELTA_RUN_HEADER_SIZE ? get_le(delta + offset, 4) : 0;
+        uint64_t count = size - offset >= DELTA_RUN_HEADER_SIZE ? get_le(delta + offset + 4, 4) : 0;
+        if (count == 0 || block_no < next_block || block_no + count > blocks ||
+            count * DELTA_BLOCK_SIZE > size - offset - DELTA_RUN_HEADER_SIZE) {
+            printf("%s is damaged\n", delta_name);
+            ok = false;
+        }
+        next_block = block_no + count;
+        offset += DELTA_RUN_HEADER_SIZE + count * DELTA_BLOCK_SIZE;
+    }
+
+    if (ok && (!hash_image(image->os8_file, image->codec, blocks, &hash) ||
+               hash != get_le(delta + 8, 8))) {
+        printf("%s isn't the image the delta was made from\n", image->name);
+        ok = false;
+    }
+
+    os8_block_t run_blocks[SCAN_CHUNK];
+    offset = DELTA_HEADER_SIZE;
+    while (ok && offset < size) {
+        unsigned block_no = get_le(delta + offset, 4);
+        unsigned count = get_le(delta + offset + 4, 4);
+        offset += DELTA_RUN_HEADER_SIZE;
+        for (unsigned done = 0; ok && done < count; ) {
+            unsigned run = MIN(SCAN_CHUNK, count - done);
+            for (unsigned i = 0; i < run * OS8_BLOCK_SIZE; i++) {
+                run_blocks[i / OS8_BLOCK_SIZE][i % OS8_BLOCK_SIZE] = get_le(delta + offset + 2 * i, 2);
+            }
+            ok = validate_words(block_no + done, run, run_blocks) &&
+                 image->codec.write_blocks(image->os8_file, block_no + done, run, run_blocks);
+            if (!ok) {
+                printf("Error writing block %u\n", block_no + done);
+            }
+            offset += (size_t)run * DELTA_BLOCK_SIZE;
+            done += run;
+        }
+    }
+    free(delta);
+    return ok;
+}
+
+/* --fanout copies the same host files to every image in a list.  The files are read
+   and packed once, into memory, and then each image only has to find room for them,
+   write the blocks and write its directory once at the end.  Several images are
+   done at a time.  An image that can't take all of the files is left with its
+   directory as it was.
+*/
+typedef struct {
+    os8_filename_t name;
+    os8_block_t *blocks;
+    unsigned count;
+    unsigned capacity;
+} encoded_file_t;
 
-            if (is_dir_p) {
-                strcat(output_path, "/");
-                strcat(output_path, filename);
-            } 
+bool append_block(encoded_file_t *file, os8_block_t block, unsigned word_cnt)
+{
+    if (file->count == file->capacity) {
+        unsigned capacity = MAX(file->capacity * 2, 16);
+        os8_block_t *grown = realloc(file->blocks, capacity * sizeof(os8_block_t));
+        if (grown == NULL) {
+            perror("realloc");
+            return false;
+        }
+        file->blocks = grown;
+        file->capacity = capacity;
+    }
+    memcpy(file->blocks[file->count], block, word_cnt * sizeof(pdp8_word_t));
+    memset(file->blocks[file->count] + word_cnt, 0, (OS8_BLOCK_SIZE - word_cnt) * sizeof(pdp8_word_t));
+    file->count++;
+    return true;
+}
 
-            filename_type_t type = filename_type(filename);
-            FILE *output;
-            if ((output = fopen(output_path, type == text_type ? "w" : "wb")) == NULL) {
-                perror("Error opening output file:");
-                return false;
+/* The same packing as stream_host_char_file and stream_host_image_file */
+bool encode_host_file(FILE *input, filename_type_t type, encoded_file_t *file)
+{
+    os8_block_t block;
+    bool ok = true;
+
+    if (type == unknown_type) {
+        size_t cnt;
+        while (ok && (cnt = fread(block, 2, OS8_BLOCK_SIZE, input)) > 0) {
+            ok = append_block(file, block, cnt);
+        }
+        return ok && !ferror(input);
+    }
+
+    encoder_t encoder;
+    unsigned char *buffer;
+    size_t length;
+
+    if ((buffer = malloc(HOST_BUFFER_SIZE)) == NULL) {
+        perror("malloc");
+        return false;
+    }
+    init_encoder(&encoder, type, block, OS8_BLOCK_SIZE);
+    while (ok && !encoder.ctrl_z_seen &&
+           (length = fread(buffer, 1, HOST_BUFFER_SIZE, input)) > 0) {
+        for (size_t done = 0; ok && done < length;) {
+            done += feed_encoder(&encoder, buffer + done, length - done);
+            if (encoder_full_p(&encoder)) {
+                ok = append_block(file, block, encoder.word_cnt);
+                encoder_emptied(&encoder);
             }
+        }
+    }
+    free(buffer);
+    if (ok && encoder_full_p(&encoder)) {
+        ok = append_block(file, block, encoder.word_cnt);
+        encoder_emptied(&encoder);
+    }
+    if (ok) {
+        finish_encoder(&encoder);
+        ok = append_block(file, block, encoder.word_cnt);
+    }
+    return ok && !ferror(input);
+}
 
-            bool error_p;
+typedef struct {
+    encoded_file_t *files;
+    unsigned file_count;
+    char **images;
+    bool *ok;
+    unsigned image_count;
+    rk05_filesystem_t filesystem;
+    unsigned next;
+    pthread_mutex_t lock;
+} fanout_t;
+
+bool fanout_image(fanout_t *fanout, const_str_t name)
+{
+    os8_image_t image;
+    format_t format = image_format(name);
 
-            switch (type) {
-            case text_type:
-            case binary_type:
-                error_p = !stream_os8_byte_file(entry, type, os8_file, read_block, output);
-                break;
-            case unknown_type:
-                error_p = !stream_os8_image_file(entry, os8_file, read_block, output);
-                break;
+    if (format == unknown) {
+        printf("Can't tell the format of %s from its name\n", name);
+        return false;
+    }
+    if (!open_image(&image, name, format, fanout->filesystem, O_RDWR)) {
+        return false;
+    }
+    bool ok = read_image_directory(&image);
+    for (unsigned i = 0; ok && i < fanout->file_count; i++) {
+        encoded_file_t *file = &fanout->files[i];
+        entry_t entry;
+        if (!allocate_os8_file(file->name, file->count, false, image.directory, &entry)) {
+            printf("No room for %s on %s\n", file->name, name);
+            ok = false;
+        } else if (!image.codec.write_blocks(image.os8_file, entry.file_block, file->count,
+                                             file->blocks)) {
+            printf("Error writing %s to %s\n", file->name, name);
+            ok = false;
+        } else {
+            ok = enter_os8_file(file->name, file->count, image.directory, entry);
+        }
+    }
+    ok = ok && write_directory(image.codec.write_blocks, image.os8_file, image.directory);
+    return close_image(&image, ok) && ok;
+}
+
+void *fanout_worker(void *ctx)
+{
+    fanout_t *fanout = ctx;
+
+    while (true) {
+        pthread_mutex_lock(&fanout->lock);
+        unsigned i = fanout->next++;
+        pthread_mutex_unlock(&fanout->lock);
+        if (i >= fanout->image_count) {
+            return NULL;
+        }
+        fanout->ok[i] = fanout_image(fanout, fanout->images[i]);
+    }
+}
+
+/* One image path per line, blank lines and lines starting with # are skipped */
+bool read_image_list(const_str_t list_name, fanout_t *fanout)
+{
+    FILE *list = fopen(list_name, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    bool ok = true;
+
+    if (list == NULL) {
+        printf("Error opening %s: %s\n", list_name, strerror(errno));
+        return false;
+    }
+    while (ok && (length = getline(&line, &capacity, list)) != -1) {
+        while (length > 0 && isspace((unsigned char)line[length - 1])) {
+            line[--length] = '\0';
+        }
+        if (length == 0 || line[0] == '#') {
+            continue;
+        }
+        char **images = realloc(fanout->images, (fanout->image_count + 1) * sizeof(char *));
+        if (images == NULL) {
+            perror("realloc");
+            ok = false;
+            break;
+        }
+        fanout->images = images;
+        fanout->images[fanout->image_count++] = line;
+        line = NULL;
+        capacity = 0;
+    }
+    free(line);
+    fclose(list);
+    return ok;
+}
+
+bool fanout_host_files(char **argv, int first, int last, const_str_t list_name,
+                       rk05_filesystem_t filesystem, copy_mode_t mode)
+{
+    fanout_t fanout = {NULL, 0, NULL, NULL, 0, filesystem, 0, PTHREAD_MUTEX_INITIALIZER};
+    bool ok = true;
+
+    if (last - first > 1 && !os8_devicename_p(argv[last])) {
+        printf("Output file must be \"os8\"\n");
+        return false;
+    }
+    if ((fanout.files = calloc(last - first, sizeof(encoded_file_t))) == NULL) {
+        perror("calloc");
+        return false;
+    }
+
+    for (int i = first; ok && i < last; i++) {
+        bool stdin_p = strcmp(argv[i], "-") == 0;
+        encoded_file_t *file = &fanout.files[fanout.file_count++];
+
+        if (stdin_p && os8_devicename_p(argv[last])) {
+            printf("Copying from stdin needs an OS/8 file name\n");
+            ok = false;
+            break;
+        }
+        if (!host_output_name(argv[i], argv[last], file->name)) {
+            ok = false;
+            break;
+        }
+        filename_type_t type = copy_type(stdin_p ? argv[last] : argv[i], mode);
+        FILE *input = stdin_p ? stdin : fopen(argv[i], type == text_type ? "r" : "rb");
+        if (input == NULL) {
+            printf("Error opening %s: %s\n", argv[i], strerror(errno));
+            ok = false;
+            break;
+        }
+        if (!encode_host_file(input, type, file)) {
+            printf("Error reading %s\n", argv[i]);
+            ok = false;
+        }
+        if (!stdin_p) {
+            fclose(input);
+        }
+    }
+
+    if (ok && (ok = read_image_list(list_name, &fanout)) &&
+        (fanout.ok = calloc(MAX(fanout.image_count, 1), sizeof(bool))) == NULL) {
+        perror("calloc");
+        ok = false;
+    }
+    if (ok) {
+        run_workers(&fanout_worker, &fanout, fanout.image_count);
+        for (unsigned i = 0; i < fanout.image_count; i++) {
+            if (!fanout.ok[i]) {
+                printf("%s was not updated\n", fanout.images[i]);
+                ok = false;
             }
+        }
+    }
 
-            fclose(output);
+    for (unsigned i = 0; i < fanout.file_count; i++) {
+        free(fanout.files[i].blocks);
+    }
+    for (unsigned i = 0; i < fanout.image_count; i++) {
+        free(fanout.images[i]);
+    }
+    free(fanout.files);
+    free(fanout.images);
+    free(fanout.ok);
+    return ok;
+}
 
-            if (error_p) {
-                printf("Error copying OS/8 file %s to %s\n", filename, output_path);
-                return false;
+/* The store keeps snapshots of whole devices, each distinct block once.  It's a
+   directory holding:
+
+     blocks        every distinct block, two little-endian bytes per word, in the
+                   order they were first stored.  Block references count from 1,
+                   0 is a block of zeros, which isn't stored.
+     hashes        the hash of each stored block, 8 little-endian bytes each, so the
+                   blocks needn't be read to find out what's there.
+     NAME.snap     a snapshot: a header (magic, device blocks, device format and
+                   the hash --hash would give, little-endian), then runs of
+                   references covering the device in order, each the first
+                   reference and how many blocks follow on.  References in a run
+                   go up by one, or stay 0 for zeros, so a run of new blocks or of
+                   unchanged ones is a single entry.
+
+   A hash match isn't trusted, the blocks are compared too.
+*/
+#define SNAPSHOT_MAGIC "OS8SNP1\n"
+#define SNAPSHOT_HEADER_SIZE 24
+#define SNAPSHOT_RUN_SIZE 8
+#define STORE_BLOCK_SIZE (OS8_BLOCK_SIZE * 2)
+
+typedef struct {
+    uint64_t hash;
+    uint32_t ref;
+} store_slot_t;
+
+typedef struct {
+    int blocks_file;
+    unsigned char *old_blocks;      /* mapped, those stored before this put */
+    uint32_t old_count;
+    unsigned char *new_blocks;      /* added by this put, not yet written */
+    uint32_t new_count;
+    uint32_t new_capacity;
+    uint64_t *new_hashes;
+    store_slot_t *slots;
+    size_t slot_mask;
+    uint32_t *refs;                 /* one per device block */
+    uint64_t device_hash;
+    unsigned block_cnt;
+} store_t;
+
+void encode_store_block(os8_block_t block, unsigned char *bytes)
+{
+    for (unsigned i = 0; i < OS8_BLOCK_SIZE; i++) {
+        bytes[2 * i] = block[i] & 0377;
+        bytes[2 * i + 1] = block[i] >> 8;
+    }
+}
+
+unsigned char *store_block(store_t *store, uint32_t ref)
+{
+    return ref <= store->old_count ?
+           store->old_blocks + (size_t)(ref - 1) * STORE_BLOCK_SIZE :
+           store->new_blocks + (size_t)(ref - store->old_count - 1) * STORE_BLOCK_SIZE;
+}
+
+/* The table has room for every block there could be, so it never fills */
+store_slot_t *find_store_slot(store_t *store, uint64_t hash, unsigned char *bytes)
+{
+    size_t i = hash & store->slot_mask;
+
+    while (store->slots[i].ref != 0 &&
+           (store->slots[i].hash != hash ||
+            memcmp(store_block(store, store->slots[i].ref), bytes, STORE_BLOCK_SIZE) != 0)) {
+        i = (i + 1) & store->slot_mask;
+    }
+    return &store->slots[i];
+}
+
+bool store_run(unsigned block_no, unsigned count, os8_block_t *blocks, bool hole_p, void *ctx)
+{
+    store_t *store = ctx;
+    unsigned char bytes[STORE_BLOCK_SIZE];
+    static const os8_block_t zeros;
+
+    store->device_hash = hash_words(store->device_hash, blocks[0], (size_t)count * OS8_BLOCK_SIZE);
+    for (unsigned i = 0; i < count; i++) {
+        if (hole_p || memcmp(blocks[i], zeros, sizeof(os8_block_t)) == 0) {
+            store->refs[store->block_cnt++] = 0;
+            continue;
+        }
+        uint64_t hash = hash_words(HASH_INIT, blocks[i], OS8_BLOCK_SIZE);
+        encode_store_block(blocks[i], bytes);
+        store_slot_t *slot = find_store_slot(store, hash, bytes);
+        if (slot->ref == 0) {
+            if (store->new_count == store->new_capacity) {
+                uint32_t capacity = MAX(store->new_capacity * 2, SCAN_CHUNK);
+                unsigned char *grown = realloc(store->new_blocks, (size_t)capacity * STORE_BLOCK_SIZE);
+                if (grown == NULL) {
+                    perror("realloc");
+                    return false;
+                }
+                store->new_blocks = grown;
+                uint64_t *grown_hashes = realloc(store->new_hashes, capacity * sizeof(uint64_t));
+                if (grown_hashes == NULL) {
+                    perror("realloc");
+                    return false;
+                }
+                store->new_hashes = grown_hashes;
+                store->new_capacity = capacity;
             }
+            memcpy(store->new_blocks + (size_t)store->new_count * STORE_BLOCK_SIZE, bytes,
+                   STORE_BLOCK_SIZE);
+            store->new_hashes[store->new_count++] = hash;
+            slot->hash = hash;
+            slot->ref = store->old_count + store->new_count;
         }
-    } 
+        store->refs[store->block_cnt++] = slot->ref;
+    }
     return true;
 }
 
-bool copy_host_files(char **argv, int first, int last, int os8_file,
-                    block_io_t write_block, directory_t directory)
+/* Opens (making it if need be) and locks the store's block file, and maps it */
+bool open_store(const_str_t store_name, bool write_p, store_t *store)
+{
+    char path[strlen(store_name) + sizeof("/hashes")];
+    struct stat stat_buf;
 
-/* Copy from the host to the OS/8 device  image file.
+    if (write_p && mkdir(store_name, S_IRWXU | S_IRWXG | S_IRWXO) == -1 && errno != EEXIST) {
+        printf("Error creating %s: %s\n", store_name, strerror(errno));
+        return false;
+    }
+    sprintf(path, "%s/blocks", store_name);
+    if ((store->blocks_file = open(path, write_p ? O_RDWR | O_CREAT : O_RDONLY,
+                                   S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)) == -1) {
+        printf("Error opening %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (flock(store->blocks_file, write_p ? LOCK_EX : LOCK_SH) == -1 ||
+        fstat(store->blocks_file, &stat_buf) == -1) {
+        perror(path);
+        close(store->blocks_file);
+        return false;
+    }
 
-   We are guaranteed that the last argument is a legal OS/8 device or
-   file spec.
+    /* a put that died part way may have left part of a block at the end */
+    store->old_count = stat_buf.st_size / STORE_BLOCK_SIZE;
+    store->old_blocks = NULL;
+    if (store->old_count != 0 &&
+        (store->old_blocks = mmap(NULL, (size_t)store->old_count * STORE_BLOCK_SIZE, PROT_READ,
+                                  MAP_SHARED, store->blocks_file, 0)) == MAP_FAILED) {
+        perror(path);
+        close(store->blocks_file);
+        return false;
+    }
+    return true;
+}
 
-   If there is only one file to copy we can copy to a specific s8 file, otherwise the
-   target argument must be "os8:".
+void close_store(store_t *store)
+{
+    if (store->old_blocks != NULL) {
+        munmap(store->old_blocks, (size_t)store->old_count * STORE_BLOCK_SIZE);
+    }
+    close(store->blocks_file);
+}
+
+void add_store_hash(store_t *store, uint64_t hash, uint32_t ref)
+{
+    store_slot_t *slot = find_store_slot(store, hash, store_block(store, ref));
+    slot->hash = hash;
+    slot->ref = ref;
+}
+
+/* Fills the table from the hashes of what's already stored.  A put that died after
+   adding its blocks but before adding their hashes leaves blocks at the end that
+   hashes doesn't cover, so their hashes are worked out again and added.
 */
+bool load_store_hashes(const_str_t store_name, store_t *store)
 {
-    /* We will only copy multiple files to "os8:", just like the "cp" command
-       in Unix-like systems.
-    */
+    char path[strlen(store_name) + sizeof("/hashes")];
+    unsigned char bytes[8];
+    os8_block_t block;
+    uint32_t ref;
+    bool ok = true;
 
-    if ((last - first > 1 && !os8_devicename_p(argv[last]))) {
-        printf("Output file must be \"os8\"\n");
+    sprintf(path, "%s/hashes", store_name);
+    FILE *hashes = fopen(path, "r+b");
+    if (hashes == NULL && errno == ENOENT) {
+        hashes = fopen(path, "w+b");
+    }
+    if (hashes == NULL) {
+        printf("Error opening %s: %s\n", path, strerror(errno));
         return false;
     }
+    for (ref = 1; ref <= store->old_count && fread(bytes, 1, 8, hashes) == 8; ref++) {
+        add_store_hash(store, get_le(bytes, 8), ref);
+    }
+    if (ref <= store->old_count) {
+        ok = !ferror(hashes) && fseeko(hashes, (off_t)(ref - 1) * 8, SEEK_SET) == 0;
+        for (; ok && ref <= store->old_count; ref++) {
+            unsigned char *stored = store_block(store, ref);
+            for (unsigned i = 0; i < OS8_BLOCK_SIZE; i++) {
+                block[i] = get_le(stored + 2 * i, 2);
+            }
+            uint64_t hash = hash_words(HASH_INIT, block, OS8_BLOCK_SIZE);
+            add_store_hash(store, hash, ref);
+            put_le(bytes, hash, 8);
+            ok = fwrite(bytes, 8, 1, hashes) == 1;
+        }
+        ok = fflush(hashes) == 0 && fdatasync(fileno(hashes)) == 0 && ok;
+    }
+    ok = fclose(hashes) == 0 && ok;
+    if (!ok) {
+        printf("Error adding the missing hashes to %s: %s\n", path, strerror(errno));
+    }
+    return ok;
+}
 
-    bool error_p = false;
-    filename_type_t type;
-
-    for (int i = first; i < last && !error_p; i++) {
-        type = filename_type(argv[i]);
-        FILE *input;
-        if ((input = fopen(argv[i], type == text_type ? "r" : "rb")) == NULL) {
-            perror("Error opening input file:");
-            return false;
+/* The runs of references, as described above */
+bool write_snapshot(const_str_t store_name, const_str_t snapshot_name, store_t *store,
+                    format_t device_format, unsigned blocks)
+{
+    char path[strlen(store_name) + strlen(snapshot_name) + sizeof("/.snap.new")];
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    unsigned char run[SNAPSHOT_RUN_SIZE];
+    bool ok;
+
+    sprintf(path, "%s/%s.snap.new", store_name, snapshot_name);
+    FILE *snapshot = fopen(path, "wb");
+    if (snapshot == NULL) {
+        printf("Error creating %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    put_le(header + 8, blocks, 4);
+    put_le(header + 12, device_format, 4);
+    put_le(header + 16, store->device_hash, 8);
+    ok = fwrite(header, SNAPSHOT_HEADER_SIZE, 1, snapshot) == 1;
+
+    for (unsigned i = 0; ok && i < blocks;) {
+        unsigned count = 1;
+        uint32_t first = store->refs[i];
+        while (i + count < blocks &&
+               store->refs[i + count] == (first == 0 ? 0 : first + count)) {
+            count++;
         }
+        put_le(run, first, 4);
+        put_le(run + 4, count, 4);
+        ok = fwrite(run, SNAPSHOT_RUN_SIZE, 1, snapshot) == 1;
+        i += count;
+    }
+    ok = fflush(snapshot) == 0 && fdatasync(fileno(snapshot)) == 0 && ok;
+    ok = fclose(snapshot) == 0 && ok;
+
+    char final_path[sizeof(path)];
+    sprintf(final_path, "%s/%s.snap", store_name, snapshot_name);
+    if (!ok || rename(path, final_path) == -1) {
+        printf("Error writing %s: %s\n", final_path, strerror(errno));
+        unlink(path);
+        return false;
+    }
+    return true;
+}
 
-        struct stat stat_buf;
+/* The new blocks go to the store before the snapshot that refers to them */
+bool put_snapshot(os8_image_t *image, const_str_t store_name, const_str_t snapshot_name)
+{
+    store_t store = {0};
+    unsigned blocks;
+    bool ok;
 
-        if (fstat(fileno(input), &stat_buf) == -1) {
-            perror("stat of host file failed:");
-            return false;
-        }
+    if (strchr(snapshot_name, '/') != NULL || snapshot_name[0] == '\0') {
+        printf("A snapshot name can't contain /\n");
+        return false;
+    }
+    if (!count_image_blocks(image, &blocks) || !open_store(store_name, true, &store)) {
+        return false;
+    }
 
-        os8_filename_t outputname = {'\0'};
-        if (os8_devicename_p(argv[last])) {
-            char *path = strdup(argv[i]);
-            char *base = basename(path);
-            if (!os8_filename_p(base)) {
-                printf("\"%s\" is not a legal OS/8 filename\n", path);
-                return false;
-            }
-            strcat(outputname, base);
-        } else {
-            strcat(outputname, strip_device(argv[last]));
+    size_t slots = 1;
+    while (slots < 2 * ((size_t)store.old_count + blocks)) {
+        slots *= 2;
+    }
+    store.slot_mask = slots - 1;
+    store.device_hash = HASH_INIT;
+    ok = (store.slots = calloc(slots, sizeof(store_slot_t))) != NULL &&
+         (store.refs = malloc(MAX(blocks, 1) * sizeof(uint32_t))) != NULL;
+    if (!ok) {
+        perror("malloc");
+    }
+    ok = ok && load_store_hashes(store_name, &store) &&
+         read_runs(image->os8_file, image->codec, 0, blocks, &store_run, &store);
+
+    if (ok && store.new_count != 0) {
+        char path[strlen(store_name) + sizeof("/hashes")];
+        unsigned char bytes[8];
+
+        ok = pwrite(store.blocks_file, store.new_blocks, (size_t)store.new_count * STORE_BLOCK_SIZE,
+                    (off_t)store.old_count * STORE_BLOCK_SIZE) ==
+             (ssize_t)((size_t)store.new_count * STORE_BLOCK_SIZE) &&
+             fdatasync(store.blocks_file) == 0;
+
+        sprintf(path, "%s/hashes", store_name);
+        FILE *hashes = ok ? fopen(path, "r+b") : NULL;
+        if (ok && hashes == NULL && errno == ENOENT) {
+            hashes = fopen(path, "w+b");
         }
+        ok = hashes != NULL && fseeko(hashes, (off_t)store.old_count * 8, SEEK_SET) == 0;
+        for (uint32_t i = 0; ok && i < store.new_count; i++) {
+            put_le(bytes, store.new_hashes[i], 8);
+            ok = fwrite(bytes, 8, 1, hashes) == 1;
+        }
+        if (hashes != NULL) {
+            ok = fflush(hashes) == 0 && fdatasync(fileno(hashes)) == 0 && ok;
+            ok = fclose(hashes) == 0 && ok;
+        }
+        if (!ok) {
+            printf("Error adding blocks to %s: %s\n", store_name, strerror(errno));
+        }
+    }
 
-        switch (type) {
-        case text_type:
-            error_p = !stream_host_text_file(input, os8_file,  write_block, directory,
-                                             outputname);
-            break;
-        case binary_type:
-            error_p = !stream_host_binary_file(input, os8_file,  write_block, directory,
-                                               outputname);
+    format_t device_format = image->format == packed12 ? image->packed12_header.format :
+                                                         image->format;
+    ok = ok && write_snapshot(store_name, snapshot_name, &store, device_format, blocks);
+    if (ok) {
+        printf("%u blocks, %u new\n", blocks, store.new_count);
+    }
+    free(store.slots);
+    free(store.refs);
+    free(store.new_blocks);
+    free(store.new_hashes);
+    close_store(&store);
+    return ok;
+}
+
+/* Rebuilds a snapshot as a new image, whose format comes from its extension like
+   --convert.  The image is written in order, blocks of zeros left as holes.
+*/
+bool get_snapshot(const_str_t store_name, const_str_t snapshot_name, const_str_t output_name)
+{
+    char path[strlen(store_name) + strlen(snapshot_name) + sizeof("/.snap")];
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    unsigned char run[SNAPSHOT_RUN_SIZE];
+    os8_block_t blocks[SCAN_CHUNK];
+    store_t store = {0};
+    codec_t output_codec;
+    int output_file;
+    FILE *snapshot;
+
+    sprintf(path, "%s/%s.snap", store_name, snapshot_name);
+    if ((snapshot = fopen(path, "rb")) == NULL) {
+        printf("Error opening %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    unsigned device_blocks_cnt = 0;
+    format_t device_format = unknown;
+    bool ok = fread(header, SNAPSHOT_HEADER_SIZE, 1, snapshot) == 1 &&
+              memcmp(header, SNAPSHOT_MAGIC, 8) == 0;
+    if (ok) {
+        device_blocks_cnt = get_le(header + 8, 4);
+        device_format = get_le(header + 12, 4);
+        ok = device_format > unknown && device_format <= tu56 && device_format != packed12;
+    }
+    if (!ok) {
+        printf("%s isn't a snapshot\n", path);
+        fclose(snapshot);
+        return false;
+    }
+
+    format_t output_format = format_from_extension(output_name);
+    if (output_format == unknown) {
+        printf("Can't tell the format of %s from its extension\n", output_name);
+        fclose(snapshot);
+        return false;
+    }
+    if (output_format == rk05 && device_format == simh_rk05) {
+        output_format = simh_rk05;
+    }
+    if (!open_store(store_name, false, &store)) {
+        fclose(snapshot);
+        return false;
+    }
+    if (!create_image_file(output_name, output_format, device_format, device_blocks_cnt,
+                           &output_file, &output_codec)) {
+        close_store(&store);
+        fclose(snapshot);
+        return false;
+    }
+
+    uint64_t hash = HASH_INIT;
+    unsigned block_no = 0;
+    while (ok && block_no < device_blocks_cnt) {
+        if (fread(run, SNAPSHOT_RUN_SIZE, 1, snapshot) != 1) {
+            printf("%s is damaged\n", path);
+            ok = false;
             break;
-        case unknown_type:
-            error_p = !stream_host_image_file(input, os8_file,  write_block, directory,
-                                              outputname, stat_buf.st_size);
+        }
+        uint64_t first = get_le(run, 4);
+        uint64_t count = get_le(run + 4, 4);
+        if (count == 0 || count > device_blocks_cnt - block_no ||
+            (first != 0 && first + count - 1 > store.old_count)) {
+            printf("%s is damaged\n", path);
+            ok = false;
             break;
         }
-
-        if (error_p) {
-            printf("Error copying host file %s to OS/8 file %s\n", argv[i], outputname);
-            return false;
+        for (unsigned done = 0; ok && done < count;) {
+            unsigned chunk = MIN(SCAN_CHUNK, count - done);
+            if (first == 0) {
+                memset(blocks, 0, chunk * sizeof(os8_block_t));
+            } else {
+                unsigned char *bytes = store_block(&store, first + done);
+                for (unsigned i = 0; i < chunk * OS8_BLOCK_SIZE; i++) {
+                    blocks[i / OS8_BLOCK_SIZE][i % OS8_BLOCK_SIZE] = bytes[2 * i] | bytes[2 * i + 1] << 8;
+                }
+                ok = validate_words(block_no + done, chunk, blocks) &&
+                     output_codec.write_blocks(output_file, block_no + done, chunk, blocks);
+                if (!ok) {
+                    printf("Error writing block %u of %s\n", block_no + done, output_name);
+                }
+            }
+            hash = hash_words(hash, blocks[0], (size_t)chunk * OS8_BLOCK_SIZE);
+            done += chunk;
         }
+        block_no += count;
+    }
+    if (ok && hash != get_le(header + 16, 8)) {
+        printf("%s doesn't match the snapshot's hash, the store is damaged\n", output_name);
+        ok = false;
+    }
+    close_store(&store);
+    fclose(snapshot);
+    ok = close(output_file) == 0 && ok;
+    if (!ok) {
+        unlink(output_name);
     }
+    return ok;
+}
+
+/* --sum writes a new sidecar for an image, next to it and renamed over any old one */
+bool sum_run(unsigned block_no, unsigned count, os8_block_t *blocks, bool hole_p, void *ctx)
+{
+    sidecar_t *sidecar = ctx;
+    update_sums(sidecar, block_no, count, blocks);
     return true;
 }
 
-bool delete_os8_files(char **argv, int first, int last, bool quiet_p, directory_t directory)
+bool make_sidecar(os8_image_t *image, unsigned blocks)
+{
+    char path[PATH_MAX];
+    char temp_name[PATH_MAX + 7];
+    sidecar_t sidecar = {.blocks = blocks, .first = 0};
+    struct stat stat_buf;
+    int temp_file;
 
-/* We are guaranteed that all of the files on the command line are os8 files,
-   possibly wildcarded.
+    if (!sidecar_name(image->name, path)) {
+        return false;
+    }
+    sidecar.size = OS8SUM_HEADER_SIZE + (size_t)blocks * OS8SUM_SIZE;
+    if ((sidecar.sums = malloc(sidecar.size)) == NULL) {
+        perror("malloc");
+        return false;
+    }
+    memcpy(sidecar.sums, OS8SUM_MAGIC, sizeof(OS8SUM_MAGIC) - 1);
+    put_le(sidecar.sums + sizeof(OS8SUM_MAGIC) - 1, blocks, OS8SUM_SIZE);
+    if (!read_runs(image->os8_file, image->codec, 0, blocks, &sum_run, &sidecar)) {
+        free(sidecar.sums);
+        return false;
+    }
 
-   In theory one could track everything in a single pass but it is simpler to
-   delete files and fix the directory structure for each file.  So that's what
-   we do.
+    snprintf(temp_name, sizeof(temp_name), "%s.XXXXXX", path);
+    if ((temp_file = mkstemp(temp_name)) == -1) {
+        printf("Error creating %s: %s\n", path, strerror(errno));
+        free(sidecar.sums);
+        return false;
+    }
+    if (stat(image->name, &stat_buf) == 0) {
+        fchmod(temp_file, stat_buf.st_mode & 0666);
+    }
+    bool ok = write_all(temp_file, sidecar.sums, sidecar.size) && fsync(temp_file) == 0;
+    ok = close(temp_file) == 0 && ok;
+    free(sidecar.sums);
+    if (!ok || rename(temp_name, path) == -1) {
+        printf("Error writing %s: %s\n", path, strerror(errno));
+        unlink(temp_name);
+        return false;
+    }
+    return true;
+}
+
+/* --scrub checks every block of an image against its sidecar.  The device is cut
+   into pieces of SCRUB_CHUNK blocks and several threads each read a piece straight
+   through at a time, marking the blocks that don't match.  A run that can't be read
+   is read again a block at a time so one bad block doesn't hide its neighbours.
+   The bad blocks, unreadable or not matching, are printed once as ranges after
+   everything has been read.
 */
+#define SCRUB_CHUNK HUGE_EXTENT
+
+typedef struct {
+    os8_image_t *image;
+    sidecar_t *sidecar;
+    bool *bad;
+    unsigned chunks;
+    unsigned next;
+    pthread_mutex_t lock;
+} scrub_t;
+
+bool block_bad_p(scrub_t *scrub, unsigned block_no, os8_block_t block)
 {
-    int deleted_files = 0;
-    for (int i = first; i <= last; i++) {
-        cursor_t cursor;
-        entry_t entry;
-        init_cursor(directory, &cursor);
-        pattern_t pattern;
+    return get_le(block_sum(scrub->sidecar, block_no), OS8SUM_SIZE) != block_checksum(block);
+}
+
+void scrub_blocks(scrub_t *scrub, unsigned block_no, unsigned count, os8_block_t *blocks)
+{
+    codec_t codec = scrub->image->codec;
+    int os8_file = scrub->image->os8_file;
 
-        build_pattern(strip_device(argv[i]), &pattern);
+    if (codec.read_blocks(os8_file, block_no, count, blocks)) {
+        for (unsigned i = 0; i < count; i++) {
+            scrub->bad[block_no + i] = block_bad_p(scrub, block_no + i, blocks[i]);
+        }
+        return;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        scrub->bad[block_no + i] = !codec.read_block(os8_file, block_no + i, blocks[i]) ||
+                                   block_bad_p(scrub, block_no + i, blocks[i]);
+    }
+}
 
-        while (valid_entry(&cursor)) {
-            peek_entry(cursor, &entry);
-            if (!entry.empty_file && entry.length != 0 &&
-                pattern_match_p(entry.name, pattern)) {
-                bool delete_file_p = true;
-                if (!quiet_p) {
-                    os8_filename_t filename;
-                    get_filename(entry.name, filename);
-                    printf("Delete file %s?", filename);
-                    delete_file_p = yes_no("");
-                }
-                if (delete_file_p) {
-                    delete_entry(&entry);
-                    deleted_files++;
-                }
-            }
-            advance_cursor(&cursor, entry);
+void *scrub_worker(void *ctx)
+{
+    scrub_t *scrub = ctx;
+    os8_block_t blocks[SCAN_CHUNK];
+
+    corruption_quiet_p = true;
+    while (true) {
+        pthread_mutex_lock(&scrub->lock);
+        unsigned i = scrub->next++;
+        pthread_mutex_unlock(&scrub->lock);
+        if (i >= scrub->chunks) {
+            corruption_quiet_p = false;
+            return NULL;
+        }
+        unsigned end = MIN((i + 1) * SCRUB_CHUNK, scrub->sidecar->blocks);
+        for (unsigned block_no = i * SCRUB_CHUNK; block_no < end; block_no += SCAN_CHUNK) {
+            scrub_blocks(scrub, block_no, MIN(SCAN_CHUNK, end - block_no), blocks);
         }
     }
+}
 
-    consolidate(directory);
+bool scrub_image(os8_image_t *image, unsigned blocks, bool *bad_p)
+{
+    sidecar_t sidecar;
+    bool found_p;
+    scrub_t scrub = {image, &sidecar, NULL, (blocks + SCRUB_CHUNK - 1) / SCRUB_CHUNK, 0,
+                     PTHREAD_MUTEX_INITIALIZER};
 
-    printf("%d files deleted\n", deleted_files);
+    if (!open_sidecar(image->name, blocks, false, &sidecar, &found_p)) {
+        return false;
+    }
+    if (!found_p) {
+        printf("%s has no sidecar, make one with --sum\n", image->name);
+        return false;
+    }
+    if ((scrub.bad = calloc(MAX(blocks, 1), sizeof(bool))) == NULL) {
+        perror("calloc");
+        close_sidecar(&sidecar);
+        return false;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    advise_blocks(image->os8_file, image->codec, 0, blocks, POSIX_FADV_SEQUENTIAL);
+#endif
+    run_workers(&scrub_worker, &scrub, scrub.chunks);
+
+    unsigned bad_blocks = 0;
+    for (unsigned block_no = 0; block_no < blocks; block_no++) {
+        if (!scrub.bad[block_no]) {
+            continue;
+        }
+        unsigned end = block_no;
+        while (end + 1 < blocks && scrub.bad[end + 1]) {
+            end++;
+        }
+        if (end == block_no) {
+            printf("Block %u doesn't match its checksum\n", block_no);
+        } else {
+            printf("Blocks %u-%u don't match their checksums\n", block_no, end);
+        }
+        bad_blocks += end - block_no + 1;
+        block_no = end;
+    }
+    if (bad_blocks != 0) {
+        printf("%s: %u of %u blocks are bad\n", image->name, bad_blocks, blocks);
+        *bad_p = true;
+    }
+    free(scrub.bad);
+    close_sidecar(&sidecar);
     return true;
 }
 
-
-/* Command line processing and main program */
-
-/* make sure all of the referenced files in the command line are either all
-   OS/8 or all host files.
-*/
-
 bool want_os8_files_p(char *argv[], int first, int last, bool want_os8_p)
 {
     for (int i = first; i <= last; i++ ) {
@@ -1853,39 +7002,62 @@ bool not_only_once_p(bool flag, char *prefix)
     return false;
 }
 
-void usage() {
+bool second_command_p(bool command_p)
+{
+    if (command_p) {
+        printf("Only one command can be given\n");
+        return true;
+    }
+    return false;
+}
+
+void usage(int status) {
     printf("An os8_file file is required with one of the following extensions:\n");
     printf("  .tu56,.dt8 (129 word or 128 word blocks, simh and MAC PDP-8/e compatible)\n");
-    printf("  .dsk (simh disk image)\n");
-    printf("  .rk05 (Mac PDP-8/e simulator RK05 format)\n");
-    exit(EXIT_FAILURE);
+    printf("  .dsk (simh disk image, --size rf08, rk05, max or a block count when creating)\n");
+    printf("  .rk05 (Mac PDP-8/e simulator or simh RK05 format, --simh when creating the latter)\n");
+    printf("  .rx01,.rx02 (simh RX01 and RX02 floppy images)\n");
+    printf("  .p12 (packed-12 image of any device, 2 words in 3 bytes)\n");
+    exit(status);
 }
 
 int main(int argc, char *argv[])
 {
-    char *dot_pos;
     struct stat stat_buf;
     char *os8_devicename = NULL;
-    int os8_file;
-    directory_t directory;
-    block_io_t read_block;
-    block_io_t write_block;
+    os8_image_t image;
     format_t format = unknown;
     rk05_filesystem_t rk05_filesystem = base;
     const_str_t match_filename = "*.*";
     bool print_empties_p = false;
+    long dsk_blocks = 0;
+    bool simh_p = false;
+    char *convert_name = NULL;
+    char *grep_pattern = NULL;
+    char *catalog_arg = NULL;
+    char *diff_name = NULL;
+    char *delta_name = NULL;
+    char *fanout_list = NULL;
+    char *store_name = NULL;
+    bool blocks_p = false;
+    device_t device;
 
     /* Process command line */
 
-    enum {none, dir, delete, create, zero, copy_to_os8, copy_from_os8, print_from_os8} command;
+    enum {none, dir, delete, create, zero, convert, hash, grep, diff, make_delta, apply_delta,
+         catalog_build, catalog_find, index_build, index_find, fanout, store_put, store_get,
+         sum, scrub, copy_to_os8, copy_from_os8, print_from_os8} command = none;
     bool quiet_p = false;
     long columns = 2;
     bool columns_p = false;
     bool command_err_p = false;
     bool exists_p = false; /* allows one to create a filesystem on an existing file */
     char *temp;
-    bool force_text_p = false;
-    bool force_image_p = false;
+    copy_mode_t mode = no_mode;
+    range_t range;
+    bool range_p = false;
+    bool verify_p = false;
+    verify_t verify;
 
     int c;
     while (1) {
@@ -1909,6 +7081,12 @@ int main(int argc, char *argv[])
             {"os8",  required_argument, 0, '8'},
             /* PDP-8/e sim format, override auto detection */
             {"rk05", no_argument, 0, 'K'},
+            /* RK05 images are in simh format, override auto detection */
+            {"simh", no_argument, 0, 'H'},
+            /* simh disk format, override auto detection */
+            {"dsk", no_argument, 0, 'k'},
+            /* size of a new dsk image, rf08, rk05, max or a block count */
+            {"size", required_argument, 0, 'z'},
 
             /* RK05 disks have two file systems, RKAn and RKBn.
                These work with both SIMH and PDP-8/e disk images.
@@ -1916,17 +7094,62 @@ int main(int argc, char *argv[])
             {"rka", no_argument, 0, 'A'},
             {"rkb", no_argument, 0, 'B'},
 
+            /* Forces RX01 or RX02 floppy */
+            {"rx01", no_argument, 0, '1'},
+            {"rx02", no_argument, 0, '2'},
+
             /* Forces DECTape */
             {"tu56", no_argument, 0, 'D'},
             {"dt8", no_argument, 0, 'D'},
 
-            /* Force output mode, overriding auto detection by extension */
-            /* ignored at the moment */
+            /* Force copy mode, overriding auto detection by extension */
             {"text", no_argument, 0, 't'},
             {"image", no_argument, 0, 'i'},
 
             /* Zero out the directory of an existing file, or create a new one */ 
             {"zero", no_argument, 0, 'Z'},
+
+            /* Copy the whole device to a new image file, possibly of another format */
+            {"convert", required_argument, 0, 'V'},
+
+            /* Print a hash of the whole device's contents */
+            {"hash", no_argument, 0, 'h'},
+
+            /* Write a checksum of each block to a sidecar, and check the image against it */
+            {"sum", no_argument, 0, 'u'},
+            {"scrub", no_argument, 0, 's'},
+
+            /* Read back and check what's written when copying files or converting */
+            {"verify", no_argument, 0, 'v'},
+
+            /* Print only START:LEN of a file */
+            {"range", required_argument, 0, 'r'},
+
+            /* Print the lines of text files matching a regular expression */
+            {"grep", required_argument, 0, 'g'},
+
+            /* Index every file of the images under a directory, and search the index */
+            {"catalog-build", required_argument, 0, 'b'},
+            {"catalog-find", required_argument, 0, 'f'},
+
+            /* Compare with another image, by file or with --blocks block by block */
+            {"diff", required_argument, 0, 'y'},
+            {"blocks", no_argument, 0, 'l'},
+
+            /* Write the blocks that changed between two images, and apply them */
+            {"make-delta", required_argument, 0, 'm'},
+            {"apply-delta", required_argument, 0, 'a'},
+
+            /* Snapshot an image into a deduplicating store, and get it back */
+            {"store-put", required_argument, 0, 'p'},
+            {"store-get", required_argument, 0, 'G'},
+
+            /* Copy host files to every image in a list */
+            {"fanout", required_argument, 0, 'o'},
+
+            /* Index the words in the text files of the images under a directory */
+            {"index-build", required_argument, 0, 'I'},
+            {"index-find", required_argument, 0, 'F'},
             {0, 0, 0, 0}
         };
 
@@ -1943,25 +7166,89 @@ int main(int argc, char *argv[])
         switch (c) {
 
         case 'C':
-            command_err_p = not_only_once_p(command != none, "--dir/--del/--create/--zero");
+            command_err_p = second_command_p(command != none);
             command = create;
             break;
 
         case 'd':
-            command_err_p = not_only_once_p(command != none, "--dir/--del/--create/--zero");
+            command_err_p = second_command_p(command != none);
             command = dir;
             break;
 
         case 'x':
-            command_err_p = not_only_once_p(command != none, "--dir/--del/--create/--zero");
+            command_err_p = second_command_p(command != none);
             command = delete;
             break;
 
         case 'Z':
-            command_err_p = not_only_once_p(command != none, "--dir/--del/--create/--zero");
+            command_err_p = second_command_p(command != none);
             command = zero;
             break;
 
+        case 'V':
+            command_err_p = second_command_p(command != none);
+            command = convert;
+            convert_name = optarg;
+            break;
+
+        case 'h':
+            command_err_p = second_command_p(command != none);
+            command = hash;
+            break;
+
+        case 'u':
+        case 's':
+            command_err_p = second_command_p(command != none);
+            command = c == 'u' ? sum : scrub;
+            break;
+
+        case 'g':
+            command_err_p = second_command_p(command != none);
+            command = grep;
+            grep_pattern = optarg;
+            break;
+
+        case 'y':
+            command_err_p = second_command_p(command != none);
+            command = diff;
+            diff_name = optarg;
+            break;
+
+        case 'p':
+        case 'G':
+            command_err_p = second_command_p(command != none);
+            command = c == 'p' ? store_put : store_get;
+            store_name = optarg;
+            break;
+
+        case 'o':
+            command_err_p = second_command_p(command != none);
+            command = fanout;
+            fanout_list = optarg;
+            break;
+
+        case 'm':
+        case 'a':
+            command_err_p = second_command_p(command != none);
+            command = c == 'm' ? make_delta : apply_delta;
+            delta_name = optarg;
+            break;
+
+        case 'l':
+            command_err_p = not_only_once_p(blocks_p, "--blocks");
+            blocks_p = true;
+            break;
+
+        case 'b':
+        case 'f':
+        case 'I':
+        case 'F':
+            command_err_p = second_command_p(command != none);
+            command = c == 'b' ? catalog_build : c == 'f' ? catalog_find :
+                      c == 'I' ? index_build : index_find;
+            catalog_arg = optarg;
+            break;
+
         case 'E':
             command_err_p = not_only_once_p(exists_p, "--exists");;
             exists_p = true;
@@ -1974,8 +7261,34 @@ int main(int argc, char *argv[])
           
         case 'K':
         case 'D':
+        case 'k':
+        case '1':
+        case '2':
             command_err_p = not_only_once_p(format != unknown, "Device flag");
-            format = c == 'K' ? rk05 : dectape;
+            format = c == 'K' ? rk05 : c == 'k' ? dsk : c == '1' ? rx01 : c == '2' ? rx02 : dectape;
+            break;
+
+        case 'H':
+            command_err_p = not_only_once_p(simh_p, "--simh");
+            simh_p = true;
+            break;
+
+        case 'z':
+            command_err_p = not_only_once_p(dsk_blocks != 0, "--size");
+            if (strcmp(optarg, "rf08") == 0) {
+                dsk_blocks = RF08_BLOCKS;
+            } else if (strcmp(optarg, "rk05") == 0) {
+                dsk_blocks = RK05_BLOCKS;
+            } else if (strcmp(optarg, "max") == 0) {
+                dsk_blocks = DSK_MAX_BLOCKS;
+            } else {
+                dsk_blocks = strtol(optarg, &temp, 10);
+                if (*temp != '\0' || dsk_blocks <= FIRST_DIR_BLOCK + DIR_LENGTH ||
+                    dsk_blocks > DSK_MAX_BLOCKS) {
+                    printf("Illegal value for --size\n");
+                    command_err_p = true;
+                }
+            }
             break;
 
         case 'A':
@@ -1999,13 +7312,13 @@ int main(int argc, char *argv[])
             break;
 
         case 't':
-            command_err_p = not_only_once_p(force_text_p, "--text");;
-            force_text_p = true;
+            command_err_p = not_only_once_p(mode != no_mode, "--text/--image");
+            mode = text_mode;
             break;
 
         case 'i':
-            command_err_p = not_only_once_p(force_image_p, "--image");;
-            force_image_p = true;
+            command_err_p = not_only_once_p(mode != no_mode, "--text/--image");
+            mode = image_mode;
             break;
 
         case 'e':
@@ -2013,6 +7326,24 @@ int main(int argc, char *argv[])
             print_empties_p = true;
             break;
 
+        case 'v':
+            command_err_p = not_only_once_p(verify_p, "--verify");
+            verify_p = true;
+            break;
+
+        case 'r':
+            command_err_p = not_only_once_p(range_p, "--range");
+            range_p = true;
+            range.start = strtoull(optarg, &temp, 10);
+            if (*temp == ':') {
+                range.length = strtoull(temp + 1, &temp, 10);
+            }
+            if (*temp != '\0' || strchr(optarg, ':') == NULL || !isdigit(*optarg)) {
+                printf("Illegal value for --range, it must be START:LEN\n");
+                command_err_p = true;
+            }
+            break;
+
         case '?':
             /* getopt_long already printed an error message. */
             command_err_p = true;
@@ -2031,10 +7362,23 @@ int main(int argc, char *argv[])
         command_err_p = true;
     }
 
-    if (os8_devicename == NULL) {
+    if (dsk_blocks != 0 && command != create) {
+        printf("--size can only be used with the --create switch\n");
+        command_err_p = true;
+    }
+
+    bool many_images_p = command == catalog_build || command == catalog_find ||
+                     command == index_build || command == index_find || command == fanout ||
+                     command == store_get;
+    if (os8_devicename == NULL && !many_images_p) {
         printf("OS/8 device file name must be specified\n");
         command_err_p = true;
     }
+
+    if (os8_devicename != NULL && many_images_p) {
+        printf("--catalog-build/--catalog-find/--index-build/--index-find/--fanout/--store-get don't take --os8\n");
+        command_err_p = true;
+    }
  
     if (columns_p && command != dir) {
         printf("--columns can only be specified with --dir\n");
@@ -2077,6 +7421,19 @@ int main(int argc, char *argv[])
             }
             break;
 
+        case convert:
+        case hash:
+        case sum:
+        case scrub:
+        case diff:
+        case make_delta:
+        case apply_delta:
+            if (extra_arg_count != 0) {
+                printf("Too many files for --convert, --hash, --sum, --scrub, --diff or a delta\n");
+                command_err_p = true;
+            }
+            break;
+
         case delete:
             if (!want_os8_files_p(argv, optind, argc - 1, true)) {
                 printf("Can only delete OS/8 files\n");
@@ -2084,19 +7441,55 @@ int main(int argc, char *argv[])
             }
             break;
 
+        case catalog_build:
+        case catalog_find:
+        case index_build:
+        case index_find:
+            if (extra_arg_count != 1) {
+                printf("--catalog-build/--catalog-find/--index-build/--index-find need the name of the index\n");
+                command_err_p = true;
+            }
+            break;
+
+        case store_put:
+            if (extra_arg_count != 1) {
+                printf("--store-put needs the name of the snapshot\n");
+                command_err_p = true;
+            }
+            break;
+
+        case store_get:
+            if (extra_arg_count != 2) {
+                printf("--store-get needs the name of the snapshot and of the new image\n");
+                command_err_p = true;
+            }
+            break;
+
+        case fanout:
+            if (argc - optind < 2 ||
+                !(os8_devicename_p(argv[argc - 1]) || os8_file_spec_p(argv[argc - 1])) ||
+                !want_os8_files_p(argv, optind, argc - 2, false)) {
+                printf("--fanout copies host files to an OS/8 file or directory\n");
+                command_err_p = true;
+            }
+            break;
+
+        case grep:
+            if (!want_os8_files_p(argv, optind, argc - 1, true)) {
+                printf("Can only search OS/8 files\n");
+                command_err_p = true;
+            }
+            break;
+
         case none:
             if (argc - optind == 0) {
                 printf("No files to copy\n");
                 command_err_p = true;
+            } else if (want_os8_files_p(argv, optind, argc - 1, true)) {
+                command = print_from_os8;
             } else if (argc - optind == 1) {
-                if (os8_file_spec_p(argv[optind]) &&
-                    !os8_contains_wildcard_p(argv[optind]) &&
-                    filename_type(argv[optind]) == text_type) {
-                        command = print_from_os8;
-                } else {
-                    printf("Filename must be an OS/8 text file with no wild cards\n");
-                    command_err_p = true;
-                }
+                printf("Can only print OS/8 files\n");
+                command_err_p = true;
             } else if (os8_devicename_p(argv[argc - 1]) || os8_file_spec_p(argv[argc - 1])) {
                 command = copy_to_os8;
                 if (!want_os8_files_p(argv, optind, argc - 2, false)) {
@@ -2118,27 +7511,80 @@ int main(int argc, char *argv[])
             break;
     }
 
+    if (blocks_p && command != diff) {
+        printf("--blocks can only be used with --diff\n");
+        command_err_p = true;
+    }
+
+    if (range_p && command != print_from_os8) {
+        printf("--range can only be used when printing OS/8 files\n");
+        command_err_p = true;
+    }
+
+    if (verify_p && command != copy_to_os8 && command != convert) {
+        printf("--verify can only be used when copying files to OS/8 or with --convert\n");
+        command_err_p = true;
+    }
+
+    /* --diff follows diff(1): 0 if the images are the same, 1 if they differ and 2 if
+       they couldn't be compared.
+    */
+    int failure_status = command == diff ? 2 : EXIT_FAILURE;
+
     if (command_err_p) {
-        exit(EXIT_FAILURE);
+        exit(failure_status);
     }
 
     /* End of command line processing */
 
+    /* These commands work on many images, not the one given by --os8 */
+    if (command == catalog_build) {
+        exit(build_catalog(catalog_arg, argv[optind]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (command == catalog_find) {
+        exit(find_catalog(catalog_arg, argv[optind]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (command == index_build) {
+        exit(build_word_index(catalog_arg, argv[optind]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (command == index_find) {
+        exit(find_word(catalog_arg, argv[optind]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (command == store_get) {
+        exit(get_snapshot(store_name, argv[optind], argv[optind + 1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (command == fanout) {
+        exit(fanout_host_files(argv, optind, argc - 1, fanout_list, rk05_filesystem, mode) ?
+             EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    /* Everything printed while making a delta is a diagnostic, so stdout is pointed at
+       stderr and the delta goes to what was stdout.
+    */
+    int delta_file = -1;
+    if (command == make_delta) {
+        fflush(stdout);
+        if ((delta_file = dup(STDOUT_FILENO)) == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+            perror("dup");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     /* if the user didn't specify the os8 file format, try to figure it out */
     if (format == unknown) {
-        if ((dot_pos = strrchr(os8_devicename, '.')) != NULL) {
-            if (strcmp(dot_pos, ".tu56") == 0 || strcmp(dot_pos, ".dt8") == 0) {
-               format = dectape;
-            } else if (strcmp(dot_pos, ".dsk") == 0) {
-                format = dsk;
-            } else if (strcmp(dot_pos, ".rk05") == 0) {
-                format = rk05;
-            }
-        }
+        format = image_format(os8_devicename);
     }
 
     if (format == unknown) {
-        usage();
+        usage(failure_status);
+    }
+
+    if (simh_p) {
+        if (format != rk05) {
+            printf("--simh can only be used with RK05 images\n");
+            exit(EXIT_FAILURE);
+        }
+        format = simh_rk05;
     }
 
     int oflags = 0;
@@ -2146,89 +7592,79 @@ int main(int argc, char *argv[])
         case copy_to_os8:
         case delete:
         case zero:
+        case apply_delta:
             oflags = O_RDWR;
             break;
         case print_from_os8:
         case copy_from_os8:
         case dir:
+        case convert:
+        case hash:
+        case sum:
+        case scrub:
+        case grep:
+        case diff:
+        case make_delta:
+        case store_put:
             oflags = O_RDONLY;
             break;
         case create:
-            oflags = exists_p ? O_WRONLY : O_WRONLY |  O_CREAT | O_EXCL;
+            /* read access too, some formats have to update partial tracks */
+            oflags = exists_p ? O_RDWR : O_RDWR |  O_CREAT | O_EXCL;
             break;
         default:
             printf("Internal error\n");
             exit(EXIT_FAILURE);
     }
 
-    if ((os8_file = open(os8_devicename, oflags,
-         S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)) == -1) {
-        perror("Error opening --os8 file");
-        exit(EXIT_FAILURE);
+    bool whole_device_p = command == convert || command == hash || (command == diff && blocks_p) ||
+                          command == make_delta || command == apply_delta || command == store_put ||
+                          command == sum || command == scrub;
+    if (!open_image(&image, os8_devicename, format, whole_device_p ? base : rk05_filesystem,
+                    oflags)) {
+        exit(failure_status);
     }
 
-    if (flock(os8_file, LOCK_EX | LOCK_NB) == -1) {
-        close(os8_file);
-        perror("OS/8 file is locked");
-        exit(EXIT_FAILURE);
-    }
+    int os8_file = image.os8_file;
+    codec_t codec = image.codec;
+    dir_block_t *directory = image.directory;
+    format = image.format;
 
-    if ((oflags & O_CREAT) == 0 && format == dectape) {
+    /* A new packed-12 image holds a dsk of --size blocks.  An existing one keeps the
+       device it has unless --size is given, and its header isn't written until the
+       user has agreed to the create.
+    */
+    if (format == packed12 && command == create && (!exists_p || dsk_blocks != 0)) {
+        image.packed12_header = (packed12_header_t){dsk, dsk_blocks != 0 ? dsk_blocks : RK05_BLOCKS};
+    }
+    packed12_header_t packed12_header = image.packed12_header;
 
-        /* If DECTape, is the block 128 or 129 words?  This could be done by
-           inspecting the file for a valid directory under either format but
-           the PDP-8/e DECTape handler checks the file length when a DECTape
-           is mounted, so we will too.  DECTape files with 128 word blocks
-           are no different than standard Simh disk files.
-        */
+    unsigned image_blocks = 0;
+    if (whole_device_p && !count_image_blocks(&image, &image_blocks)) {
+        exit(failure_status);
+    }
 
+    /* The size of a dsk image comes from --size when creating it and from the
+       file itself otherwise.
+    */
+    if (format == dsk && command != create) {
         if (fstat(os8_file, &stat_buf) == -1) {
             perror("stat");
             exit(EXIT_FAILURE);
         }
-
-        if (format == dectape) {
-            if (stat_buf.st_size == OS8_DECTAPE_LENGTH) {
-                format = dsk;
-            } else if (stat_buf.st_size != DECTAPE_LENGTH) {
-                printf("OS/8 DECtape files must be %i bytes long, generic PDP-8 DECTape files %i bytes long\n",
-                       OS8_DECTAPE_LENGTH, DECTAPE_LENGTH);
-                exit(EXIT_FAILURE);
-            }
-        }
+        dsk_blocks = MIN(stat_buf.st_size / (OS8_BLOCK_SIZE * 2), DSK_MAX_BLOCKS);
+    } else if (format == dsk && dsk_blocks == 0) {
+        dsk_blocks = RK05_BLOCKS;
     }
 
-    /* set up reader and writer */
-    switch (format) {
-    case dsk:
-        read_block = &read_dsk_block;
-        write_block = &write_dsk_block;
-        break;
-
-    case rk05:
-        if (rk05_filesystem == rkb) {
-            read_block = &read_rkb_block;
-            write_block = &write_rkb_block;
-        } else {
-            read_block = &read_rka_block;
-            write_block = &write_rka_block;
-        }
-        break;
-
-    case dectape:
-        read_block = &read_dectape_block;
-        write_block = &write_dectape_block;
-        break;
-
-    default:
-        printf("internal error\n");
+    if ((command == create || command == zero) &&
+        !(format == packed12 ? get_packed12_device(&device, packed12_header) :
+                               get_device(&device, format, dsk_blocks))) {
         exit(EXIT_FAILURE);
-
     }
 
-    if (command != create && !read_directory(read_block, os8_file, directory)) {
-        printf("Error while reading directory - are you sure the image file is properly formatted?\n");
-        exit(EXIT_FAILURE);
+    if (command != create && !whole_device_p && !read_image_directory(&image)) {
+        exit(failure_status);
     }
 
     switch (command) {
@@ -2242,32 +7678,108 @@ int main(int argc, char *argv[])
         break;
     case zero:
         if (yes_no_sure()) {
-            if (!zero_filesystem(directory, format)) {
+            if (!zero_filesystem(directory, device)) {
                 printf("Error zeroing directory\n");
                 exit(EXIT_FAILURE);
             }
         }
         break;
     case create:
-        if (!exists_p || yes_no_sure()) {
-            if (!create_filesystem(write_block, os8_file, directory, format)) {
-                printf("Error creating directory\n");
-                exit(EXIT_FAILURE);
-            }
+        /* the directory was never read, so there's nothing to write if the user says no */
+        if (exists_p && !yes_no_sure()) {
+            close_image(&image, false);
+            exit(EXIT_SUCCESS);
+        }
+        if (format == packed12 && !write_packed12_header(os8_file, packed12_header)) {
+            perror("Error writing packed-12 header");
+            exit(EXIT_FAILURE);
+        }
+        if (!create_filesystem(codec.write_blocks, os8_file, directory, device)) {
+            printf("Error creating directory\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case convert:
+        if (!convert_image(os8_file, codec, format,
+                           format == packed12 ? packed12_header.format : format,
+                           image_blocks, convert_name, verify_p)) {
+            printf("Error converting image\n");
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case hash: {
+        uint64_t image_hash;
+        if (!hash_image(os8_file, codec, image_blocks, &image_hash)) {
+            exit(EXIT_FAILURE);
+        }
+        printf("%016llx  %s\n", (unsigned long long)image_hash, os8_devicename);
+        break;
+    }
+    case sum:
+        if (!make_sidecar(&image, image_blocks)) {
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case scrub: {
+        bool bad_p = false;
+        if (!scrub_image(&image, image_blocks, &bad_p) || bad_p) {
+            exit(EXIT_FAILURE);
         }
         break;
+    }
     case copy_to_os8:
-        if (!copy_host_files(argv, optind, argc - 1, os8_file, write_block, directory)) {
+        if (verify_p && !init_verify(&verify)) {
+            exit(EXIT_FAILURE);
+        }
+        if (!copy_host_files(argv, optind, argc - 1, os8_file, codec.write_block,
+                             verify_p ? &verify : NULL, mode, directory)) {
             exit(EXIT_FAILURE);
         }
         break;
     case copy_from_os8:
-        if (!copy_os8_files(argv, optind, argc - 1, os8_file, read_block, directory)) {
+        if (!copy_os8_files(argv, optind, argc - 1, os8_file, codec, mode, directory)) {
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case diff: {
+        bool differ_p = false;
+        if (!diff_images(&image, diff_name, whole_device_p ? base : rk05_filesystem, blocks_p,
+                         &differ_p)) {
+            exit(failure_status);
+        }
+        if (differ_p) {
+            exit(EXIT_FAILURE);
+        }
+        break;
+    }
+    case store_put:
+        if (!put_snapshot(&image, store_name, argv[optind])) {
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case make_delta:
+        if (!make_image_delta(&image, delta_name, delta_file)) {
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case apply_delta:
+        if (!apply_image_delta(&image, delta_name)) {
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case grep: {
+        /* every file if none are given */
+        char *all_files[] = {"os8:*.*"};
+        bool all_p = optind == argc;
+        if (!grep_os8_files(all_p ? all_files : argv, all_p ? 0 : optind,
+                            all_p ? 0 : argc - 1, &image, grep_pattern, mode)) {
             exit(EXIT_FAILURE);
         }
         break;
+    }
     case print_from_os8:
-        if (!print_os8_text_file(argv[optind], os8_file, read_block, directory)) {
+        if (!print_os8_files(argv, optind, argc - 1, os8_file, codec, mode,
+                             range_p ? &range : NULL, directory)) {
             exit(EXIT_FAILURE);
         }
         break;
@@ -2276,8 +7788,24 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (!write_directory(write_block, os8_file, directory)) {
+    bool modified_p = command == create || command == apply_delta ||
+                      (!whole_device_p && directory_dirty_p(directory));
+
+    if (verify_p && command == copy_to_os8) {
+        record_directory(&verify, directory);
+    }
+
+    if (!whole_device_p && !write_directory(codec.write_blocks, os8_file, directory)) {
+        exit(failure_status);
+    }
+
+    if (verify_p && command == copy_to_os8 && !verify_blocks(&verify, os8_file, codec, os8_devicename)) {
+        printf("Verification failed\n");
         exit(EXIT_FAILURE);
     }
 
+    if (!close_image(&image, modified_p)) {
+        exit(failure_status);
+    }
+
 }